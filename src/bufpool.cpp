@@ -0,0 +1,124 @@
+// bufpool.cpp
+#include "bufpool.h"
+#include <new>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Default limit on idle receive buffers; the server sets its own.
+static const size_t DEFAULT_POOL_LIMIT = 64UL << 20;
+
+BufferPool receive_buffers(DEFAULT_POOL_LIMIT);
+
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& o) {
+    if (this != &o) {
+        reset();
+        data_ = o.data_;
+        capacity_ = o.capacity_;
+        pool_ = o.pool_;
+        o.data_ = nullptr;
+        o.capacity_ = 0;
+    }
+    return *this;
+}
+
+void PooledBuffer::reset() {
+    if (data_) pool_->deallocate(data_, capacity_);
+    data_ = nullptr;
+    capacity_ = 0;
+}
+
+BufferPool::~BufferPool() {
+    for (auto& list : free_) {
+        for (char *p : list) free(p);
+    }
+}
+
+void BufferPool::set_limit(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limit_ = bytes;
+}
+
+void BufferPool::set_max_used(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_used_ = bytes;
+}
+
+size_t BufferPool::class_of(size_t size) {
+    size_t c = 0;
+    while (((size_t)1 << (c + MIN_CLASS_SHIFT)) < size) ++c;
+    return c;
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    size_t capacity = (size_t)1 << (class_of(size) + MIN_CLASS_SHIFT);
+    return PooledBuffer(allocate(capacity), capacity, this);
+}
+
+// Huge page size on x86-64 and most ARM64 kernels.
+static const size_t HUGE_PAGE_SIZE = 2UL << 20;
+
+char *BufferPool::allocate(size_t size) {
+    return take(size, false);
+}
+
+char *BufferPool::try_allocate(size_t size) {
+    return take(size, true);
+}
+
+char *BufferPool::take(size_t size, bool capped) {
+    size_t c = class_of(size);
+    size_t capacity = (size_t)1 << (c + MIN_CLASS_SHIFT);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (capped && max_used_ != 0 && used_bytes_ + capacity > max_used_) {
+            over_cap_.fetch_add(1);
+            return nullptr;
+        }
+        used_bytes_ += capacity;
+        if (!free_[c].empty()) {
+            char *p = free_[c].back();
+            free_[c].pop_back();
+            idle_bytes_ -= capacity;
+            hits_.fetch_add(1);
+            return p;
+        }
+    }
+    misses_.fetch_add(1);
+    bool huge = huge_pages_ && capacity >= HUGE_PAGE_SIZE;
+    void *p;
+    if (posix_memalign(&p, huge ? HUGE_PAGE_SIZE : (size_t)1 << MIN_CLASS_SHIFT, capacity) != 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_bytes_ -= capacity;
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    // Only a hint: without transparent huge pages this is a no-op
+    if (huge) madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+    return (char *)p;
+}
+
+void BufferPool::deallocate(char *data, size_t size) {
+    size_t capacity = (size_t)1 << (class_of(size) + MIN_CLASS_SHIFT);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_bytes_ -= capacity;
+        if (idle_bytes_ + capacity <= limit_) {
+            free_[class_of(capacity)].push_back(data);
+            idle_bytes_ += capacity;
+            return;
+        }
+    }
+    free(data);
+}
+
+size_t BufferPool::idle_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_bytes_;
+}
+
+size_t BufferPool::used_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_bytes_;
+}
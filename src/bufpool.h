@@ -0,0 +1,112 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class BufferPool;
+
+// A page-aligned, uninitialized block from a BufferPool, given back to the
+// pool when the handle is destroyed. Move-only.
+class PooledBuffer {
+public:
+    PooledBuffer() : data_(nullptr), capacity_(0), pool_(nullptr) {}
+    PooledBuffer(PooledBuffer&& o) : data_(o.data_), capacity_(o.capacity_), pool_(o.pool_) {
+        o.data_ = nullptr;
+        o.capacity_ = 0;
+    }
+    PooledBuffer& operator=(PooledBuffer&& o);
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer() { reset(); }
+
+    char *data() const { return data_; }
+    size_t capacity() const { return capacity_; }
+
+    // Return the block to its pool now.
+    void reset();
+
+private:
+    friend class BufferPool;
+    PooledBuffer(char *data, size_t capacity, BufferPool *pool)
+        : data_(data), capacity_(capacity), pool_(pool) {}
+
+    char *data_;
+    size_t capacity_;
+    BufferPool *pool_;
+};
+
+// Recycles large I/O buffers so that receiving a multi-megabyte request
+// neither zero-fills a fresh allocation nor maps and unmaps it. Blocks come
+// in power-of-two size classes from one page up; freed blocks wait on
+// their class's free list for the next request of that size, until the
+// bytes kept idle would exceed the pool's limit. Safe to use from any
+// thread.
+class BufferPool {
+public:
+    explicit BufferPool(size_t limit)
+        : limit_(limit), max_used_(0), huge_pages_(false), idle_bytes_(0), used_bytes_(0) {}
+    ~BufferPool();
+
+    // Most bytes kept idle for reuse (0 = free every block when released).
+    void set_limit(size_t bytes);
+
+    // Most bytes handed out at once by try_allocate() (0 = no cap).
+    void set_max_used(size_t bytes);
+
+    // Back blocks of 2 MiB and more with transparent huge pages, which
+    // cuts TLB misses when large images are scanned. Call before use.
+    void set_huge_pages(bool on) { huge_pages_ = on; }
+
+    // A block of at least `size` bytes, with unspecified contents.
+    PooledBuffer acquire(size_t size);
+
+    // The same without a handle: the block must be given back with
+    // deallocate() and the same `size`.
+    char *allocate(size_t size);
+    void deallocate(char *data, size_t size);
+
+    // allocate(), or null if that would take the bytes in use over the
+    // cap set with set_max_used(); the caller then allocates elsewhere.
+    char *try_allocate(size_t size);
+
+    // Requests served from a free list, and those that had to allocate.
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+
+    // try_allocate() calls refused because of the cap.
+    uint64_t over_cap() const { return over_cap_.load(); }
+
+    // Bytes held idle on the free lists, and handed out.
+    size_t idle_bytes();
+    size_t used_bytes();
+
+private:
+    static const size_t MIN_CLASS_SHIFT = 12;   // 4 KiB, one page
+    static const size_t NUM_CLASSES = 64 - MIN_CLASS_SHIFT;
+
+    // Size class holding `size` bytes: the smallest power of two from one
+    // page up.
+    static size_t class_of(size_t size);
+
+    // allocate() and try_allocate(): a block of `size`, or null if
+    // `capped` and the bytes in use would exceed max_used_.
+    char *take(size_t size, bool capped);
+
+    std::mutex mutex_;
+    std::vector<char *> free_[NUM_CLASSES];
+    size_t limit_;
+    size_t max_used_;
+    bool huge_pages_;
+    size_t idle_bytes_;
+    size_t used_bytes_;
+    std::atomic<uint64_t> hits_{0}, misses_{0}, over_cap_{0};
+};
+
+// Receive buffers shared by every connection (see FrameReader).
+extern BufferPool receive_buffers;
+
+#endif // BUFPOOL_H
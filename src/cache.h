@@ -0,0 +1,158 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Fast non-cryptographic 64-bit hash of a byte range (xxHash64 algorithm).
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed = 0);
+
+// Identifies a request by its content: the operation, a hash of each
+// image and a hash of the request parameters that affect the result
+// (variant). The image sizes are kept as well, which makes a false match
+// between two different requests even less likely.
+struct CacheKey {
+    uint64_t hash1, hash2;
+    uint32_t size1, size2;
+    char op;
+    uint64_t variant;
+
+    bool operator==(const CacheKey& o) const {
+        return hash1 == o.hash1 && hash2 == o.hash2 && size1 == o.size1
+            && size2 == o.size2 && op == o.op && variant == o.variant;
+    }
+};
+
+// Build the key for an operation on one or two images (img2 may be null).
+CacheKey make_cache_key(char op, const unsigned char *img1, size_t size1,
+                        const unsigned char *img2, size_t size2, uint64_t variant);
+
+// A finished reply as it is sent to the client.
+struct CachedReply {
+    char opcode;
+    std::vector<unsigned char> payload;
+    bool close_after;
+};
+
+// Bounded LRU cache from CacheKey to immutable values of type V. Entries
+// are split over independently locked shards so that workers rarely
+// contend; each shard evicts on its own share of the byte budget, so no
+// value larger than that share can be kept. Caches of few, large values
+// should use one shard. Hits, misses and evictions are added to the
+// counters given at construction.
+template <class V>
+class ShardedLru {
+public:
+    ShardedLru(std::atomic<uint64_t>& hits, std::atomic<uint64_t>& misses,
+               std::atomic<uint64_t>& evictions, unsigned shards = DEFAULT_SHARDS)
+        : shards_(new Shard[shards]), nshards_(shards), shard_budget_(0),
+          hits_(hits), misses_(misses), evictions_(evictions) {}
+
+    // Set the total byte budget. 0 disables the cache. Call before use.
+    void set_budget(size_t bytes) { shard_budget_ = bytes / nshards_; }
+    bool enabled() const { return shard_budget_ > 0; }
+
+    // Find the value for `key`, marking it most recently used.
+    std::shared_ptr<const V> lookup(const CacheKey& key) {
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it == s.index.end()) {
+            misses_.fetch_add(1);
+            return nullptr;
+        }
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        hits_.fetch_add(1);
+        return it->second->value;
+    }
+
+    // Add or replace the value for `key`, charging `cost` bytes against
+    // the budget and evicting least recently used entries to make room.
+    // Returns false if the value is too large to be kept at all.
+    bool store(const CacheKey& key, std::shared_ptr<const V> value, size_t cost) {
+        cost += ENTRY_OVERHEAD;
+        if (cost > shard_budget_) return false;  // would evict everything else
+        Shard& s = shard_for(key);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            s.bytes -= it->second->cost;
+            s.lru.erase(it->second);
+            s.index.erase(it);
+        }
+        while (s.bytes + cost > shard_budget_) {
+            Entry& victim = s.lru.back();
+            s.bytes -= victim.cost;
+            s.index.erase(victim.key);
+            s.lru.pop_back();
+            evictions_.fetch_add(1);
+        }
+        Entry e = { key, std::move(value), cost };
+        s.lru.push_front(std::move(e));
+        s.index[key] = s.lru.begin();
+        s.bytes += cost;
+        return true;
+    }
+
+    // Bytes currently held, and number of entries.
+    size_t bytes() {
+        size_t total = 0;
+        for (unsigned i = 0; i < nshards_; ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            total += shards_[i].bytes;
+        }
+        return total;
+    }
+    size_t entries() {
+        size_t total = 0;
+        for (unsigned i = 0; i < nshards_; ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            total += shards_[i].index.size();
+        }
+        return total;
+    }
+
+private:
+    struct KeyHash {
+        size_t operator()(const CacheKey& k) const { return (size_t)(k.hash1 ^ k.hash2 ^ k.variant); }
+    };
+    struct Entry {
+        CacheKey key;
+        std::shared_ptr<const V> value;
+        size_t cost;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;  // most recently used first
+        std::unordered_map<CacheKey, typename std::list<Entry>::iterator, KeyHash> index;
+        size_t bytes;
+
+        Shard() : bytes(0) {}
+    };
+    static const unsigned DEFAULT_SHARDS = 16;
+    // Fixed per-entry overhead charged against the budget (list node,
+    // index slot, value header).
+    static const size_t ENTRY_OVERHEAD = 128;
+
+    Shard& shard_for(const CacheKey& key) {
+        return shards_[(key.hash1 >> 32 ^ key.hash2) % nshards_];
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+    unsigned nshards_;
+    size_t shard_budget_;
+    std::atomic<uint64_t>& hits_;
+    std::atomic<uint64_t>& misses_;
+    std::atomic<uint64_t>& evictions_;
+};
+
+// Encoded replies to recently seen requests.
+typedef ShardedLru<CachedReply> ResultCache;
+
+#endif // CACHE_H
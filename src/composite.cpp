@@ -0,0 +1,155 @@
+// composite.cpp
+#include "composite.h"
+#include <opencv2/core/hal/intrin.hpp>
+
+// Blends one row of n pixels: d is the base, s the overlay.
+typedef void (*RowKernel)(uchar *d, const uchar *s, int n);
+
+// x / 255, rounded, for x <= 255 * 255.
+static inline unsigned div255(unsigned x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// Luma of a BGR pixel (BT.601 weights in 8-bit fixed point).
+static inline unsigned gray_of(const uchar *s) {
+    return (s[0] * 29 + s[1] * 150 + s[2] * 77 + 128) >> 8;
+}
+
+// One channel: overlay value o with alpha a (inv = 255 - a) over base d.
+template <bool PREMUL>
+static inline uchar blend(unsigned d, unsigned o, unsigned a, unsigned inv) {
+    return (uchar)(PREMUL ? o + div255(d * inv) : div255(o * a + d * inv));
+}
+
+#if CV_SIMD128
+template <int CN> struct Pixels;
+template <> struct Pixels<3> {
+    static void load(const uchar *p, cv::v_uint8x16 *c) {
+        cv::v_load_deinterleave(p, c[0], c[1], c[2]);
+    }
+    static void store(uchar *p, const cv::v_uint8x16 *c) {
+        cv::v_store_interleave(p, c[0], c[1], c[2]);
+    }
+};
+template <> struct Pixels<4> {
+    static void load(const uchar *p, cv::v_uint8x16 *c) {
+        cv::v_load_deinterleave(p, c[0], c[1], c[2], c[3]);
+    }
+    static void store(uchar *p, const cv::v_uint8x16 *c) {
+        cv::v_store_interleave(p, c[0], c[1], c[2], c[3]);
+    }
+};
+
+static inline cv::v_uint16x8 div255(const cv::v_uint16x8& x) {
+    cv::v_uint16x8 t = cv::v_add_wrap(x, cv::v_setall_u16(128));
+    return cv::v_shr<8>(cv::v_add_wrap(t, cv::v_shr<8>(t)));
+}
+
+// Sixteen lanes of blend<PREMUL>(), in 16-bit arithmetic.
+template <bool PREMUL>
+static inline cv::v_uint8x16 blend16(const cv::v_uint8x16& d, const cv::v_uint8x16& o,
+                                     const cv::v_uint8x16& a, const cv::v_uint8x16& inv) {
+    cv::v_uint16x8 d0, d1, o0, o1, i0, i1;
+    cv::v_expand(d, d0, d1);
+    cv::v_expand(o, o0, o1);
+    cv::v_expand(inv, i0, i1);
+    d0 = cv::v_mul_wrap(d0, i0);
+    d1 = cv::v_mul_wrap(d1, i1);
+    if (PREMUL) {
+        return cv::v_pack(cv::v_add_wrap(o0, div255(d0)), cv::v_add_wrap(o1, div255(d1)));
+    }
+    cv::v_uint16x8 a0, a1;
+    cv::v_expand(a, a0, a1);
+    d0 = cv::v_add_wrap(d0, cv::v_mul_wrap(o0, a0));
+    d1 = cv::v_add_wrap(d1, cv::v_mul_wrap(o1, a1));
+    return cv::v_pack(div255(d0), div255(d1));
+}
+
+// Vector part of a 4-channel overlay row onto a colour base. Returns the
+// number of pixels done; the scalar loop finishes the rest.
+template <int BCN, bool PREMUL>
+static int blend_row_simd(uchar *d, const uchar *s, int n) {
+    const int lanes = 16;
+    const cv::v_uint8x16 full = cv::v_setall_u8(255);
+    int x = 0;
+    for (; x <= n - lanes; x += lanes, d += lanes * BCN, s += lanes * 4) {
+        cv::v_uint8x16 o[4], b[4];
+        Pixels<4>::load(s, o);
+        Pixels<BCN>::load(d, b);
+        cv::v_uint8x16 inv = cv::v_sub_wrap(full, o[3]);
+        for (int c = 0; c < 3; ++c) b[c] = blend16<PREMUL>(b[c], o[c], o[3], inv);
+        // Resulting alpha is a + da * (1 - a), i.e. the premultiplied rule
+        if (BCN == 4) b[3] = blend16<true>(b[3], o[3], o[3], inv);
+        Pixels<BCN>::store(d, b);
+    }
+    return x;
+}
+#endif
+
+// Row kernel for a BCN-channel base and OCN-channel overlay.
+template <int BCN, int OCN, bool PREMUL>
+static void blend_row(uchar *d, const uchar *s, int n) {
+    int x = 0;
+#if CV_SIMD128
+    if (OCN == 4 && BCN != 1) {
+        x = blend_row_simd<BCN == 1 ? 3 : BCN, PREMUL>(d, s, n);
+        d += x * BCN;
+        s += x * OCN;
+    }
+#endif
+    for (; x < n; ++x, d += BCN, s += OCN) {
+        unsigned a = (OCN == 4) ? s[3] : 255;
+        if (a == 0) continue;
+        if (a == 255) {
+            // Opaque (most of a typical overlay): the overlay replaces the base
+            if (BCN == 1) {
+                d[0] = (uchar)gray_of(s);
+            } else {
+                d[0] = s[0];
+                d[1] = s[1];
+                d[2] = s[2];
+            }
+            if (BCN == 4) d[3] = 255;
+            continue;
+        }
+        unsigned inv = 255 - a;
+        if (BCN == 1) {
+            d[0] = blend<PREMUL>(d[0], gray_of(s), a, inv);
+        } else {
+            d[0] = blend<PREMUL>(d[0], s[0], a, inv);
+            d[1] = blend<PREMUL>(d[1], s[1], a, inv);
+            d[2] = blend<PREMUL>(d[2], s[2], a, inv);
+        }
+        if (BCN == 4) d[3] = blend<true>(d[3], a, a, inv);
+    }
+}
+
+// Kernels indexed by [base layout][overlay layout][mode]; base layouts
+// are 1, 3 and 4 channels, overlay layouts 3 and 4. An opaque overlay has
+// nothing to premultiply, so both modes share a kernel.
+static const RowKernel KERNELS[3][2][2] = {
+    { { blend_row<1, 3, false>, blend_row<1, 3, false> },
+      { blend_row<1, 4, false>, blend_row<1, 4, true> } },
+    { { blend_row<3, 3, false>, blend_row<3, 3, false> },
+      { blend_row<3, 4, false>, blend_row<3, 4, true> } },
+    { { blend_row<4, 3, false>, blend_row<4, 3, false> },
+      { blend_row<4, 4, false>, blend_row<4, 4, true> } },
+};
+
+bool composite(cv::Mat& base, const cv::Rect& where, const cv::Mat& overlay, AlphaMode mode) {
+    if (base.depth() != CV_8U || overlay.depth() != CV_8U
+            || overlay.rows != where.height || overlay.cols != where.width
+            || (where & cv::Rect(0, 0, base.cols, base.rows)) != where) {
+        return false;
+    }
+    int bcn = base.channels(), ocn = overlay.channels();
+    int bi = bcn == 1 ? 0 : bcn == 3 ? 1 : bcn == 4 ? 2 : -1;
+    int oi = ocn == 3 ? 0 : ocn == 4 ? 1 : -1;
+    if (bi < 0 || oi < 0) return false;
+    RowKernel kernel = KERNELS[bi][oi][mode == ALPHA_PREMULTIPLIED];
+    for (int y = 0; y < where.height; ++y) {
+        kernel(base.ptr<uchar>(where.y + y) + where.x * bcn, overlay.ptr<uchar>(y), where.width);
+    }
+    return true;
+}
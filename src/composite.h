@@ -0,0 +1,21 @@
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+#include <opencv2/opencv.hpp>
+
+// How the colour of a 4-channel overlay relates to its alpha channel.
+enum AlphaMode {
+    ALPHA_STRAIGHT,         // as decoded from PNG/WebP
+    ALPHA_PREMULTIPLIED     // colour already scaled by alpha (overlay.h)
+};
+
+// Blend `overlay` onto the `where` region of `base` with per-pixel alpha
+// ("over" operator). The overlay must already be sized to `where`; 8-bit
+// 1, 3 or 4 channel bases and 3 or 4 channel overlays are supported (a 3
+// channel overlay is opaque). On a 4-channel base the alpha is combined
+// too. Each base/overlay layout has its own compiled row kernel, with a
+// SIMD main loop where OpenCV provides 128-bit universal intrinsics.
+// Returns false for unsupported layouts.
+bool composite(cv::Mat& base, const cv::Rect& where, const cv::Mat& overlay, AlphaMode mode);
+
+#endif // COMPOSITE_H
@@ -0,0 +1,268 @@
+// detector.cpp
+#include "detector.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+// Read a whole file into memory.
+static bool read_file(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    out.assign(std::istreambuf_iterator<char>(in), {});
+    return !out.empty();
+}
+
+// Build a classifier from cascade XML held in memory. Cascades in the old
+// (pre-2.4) format can only be loaded by filename, so fall back to that.
+static bool init_cascade(cv::CascadeClassifier& cascade, const std::string& xml,
+                         const std::string& path) {
+    try {
+        cv::FileStorage fs(xml, cv::FileStorage::READ | cv::FileStorage::MEMORY);
+        if (fs.isOpened() && cascade.read(fs.getFirstTopLevelNode())) {
+            return true;
+        }
+    } catch (const cv::Exception&) {
+        // fall through to load()
+    }
+    return cascade.load(path);
+}
+
+// A face width bound in image pixels, in preprocessed pixels (0 stays 0).
+static int scaled_bound(uint32_t px, double scale) {
+    return px == 0 ? 0 : std::max(1, cvRound(px * scale));
+}
+
+// Haar or LBP face cascade, run on the equalized grayscale image.
+class CascadeDetector : public FaceDetector {
+public:
+    cv::CascadeClassifier cascade;
+
+    bool wants_colour() const { return false; }
+    bool finds_eyes() const { return false; }
+    void detect(const cv::Mat& gray, const RequestParams& params, double scale,
+                std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *eyes);
+};
+
+void CascadeDetector::detect(const cv::Mat& gray, const RequestParams& params, double scale,
+                             std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *) {
+    double factor = params.scale_factor / 1000.0;
+    int neighbors = params.min_neighbors;
+    int lo = scaled_bound(params.min_face, scale), hi = scaled_bound(params.max_face, scale);
+    if (!params.largest_face) {
+        cascade.detectMultiScale(gray, faces, factor, neighbors, 0, cv::Size(lo, lo), cv::Size(hi, hi));
+        return;
+    }
+    // Coarse to fine: search one octave of window sizes at a time, largest
+    // first, and stop at the first octave with a face. Large windows are
+    // searched on small pyramid levels, so a big face is found cheaply.
+    int top = std::min(gray.cols, gray.rows);
+    if (hi == 0 || hi > top) hi = top;
+    int floor = std::max(lo, 1);
+    faces.clear();
+    for (int band_hi = hi; band_hi >= floor && faces.empty(); band_hi /= 2) {
+        int band_lo = std::max(band_hi / 2, floor);
+        cascade.detectMultiScale(gray, faces, factor, neighbors, 0,
+                                 cv::Size(band_lo, band_lo), cv::Size(band_hi, band_hi));
+        if (band_lo == floor) break;
+    }
+    if (faces.size() > 1) {
+        auto largest = std::max_element(faces.begin(), faces.end(),
+            [](const cv::Rect& a, const cv::Rect& b) { return a.area() < b.area(); });
+        faces.assign(1, *largest);
+    }
+}
+
+#ifdef HAVE_FACE_DETECTOR_YN
+// Minimum confidence, overlap threshold for non-maximum suppression and
+// candidate limit of the YuNet backend (the OpenCV sample's values).
+static const float YUNET_SCORE = 0.9f;
+static const float YUNET_NMS = 0.3f;
+static const int YUNET_TOP_K = 5000;
+
+static cv::Ptr<cv::FaceDetectorYN> create_yunet(const std::string& path) {
+    try {
+        return cv::FaceDetectorYN::create(path, "", cv::Size(320, 320),
+                                          YUNET_SCORE, YUNET_NMS, YUNET_TOP_K);
+    } catch (const cv::Exception&) {
+        return cv::Ptr<cv::FaceDetectorYN>();
+    }
+}
+
+// YuNet CNN on the colour image. Each result row holds the face box, five
+// landmarks (right eye, left eye, nose tip, mouth corners) and a score;
+// the eye landmarks stand in for the eye cascade. The cascade tuning
+// fields do not apply, apart from the face size bounds and largest-only.
+class YunetDetector : public FaceDetector {
+public:
+    explicit YunetDetector(cv::Ptr<cv::FaceDetectorYN> net) : net_(net) {}
+
+    bool wants_colour() const { return true; }
+    bool finds_eyes() const { return true; }
+    void detect(const cv::Mat& image, const RequestParams& params, double scale,
+                std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *eyes);
+
+private:
+    cv::Ptr<cv::FaceDetectorYN> net_;
+    cv::Mat results_;
+};
+
+void YunetDetector::detect(const cv::Mat& image, const RequestParams& params, double scale,
+                           std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *eyes) {
+    faces.clear();
+    if (eyes) eyes->clear();
+    net_->setInputSize(image.size());
+    net_->detect(image, results_);
+    int lo = scaled_bound(params.min_face, scale), hi = scaled_bound(params.max_face, scale);
+    size_t largest = 0;
+    for (int r = 0; r < results_.rows; ++r) {
+        const float *d = results_.ptr<float>(r);
+        cv::Rect face(cvRound(d[0]), cvRound(d[1]), cvRound(d[2]), cvRound(d[3]));
+        face &= cv::Rect(0, 0, image.cols, image.rows);
+        if (face.area() == 0 || face.width < lo || (hi > 0 && face.width > hi)) continue;
+        if (!faces.empty() && face.area() > faces[largest].area()) largest = faces.size();
+        faces.push_back(face);
+        if (!eyes) continue;
+        // A square a quarter of the face wide around each eye centre
+        std::vector<cv::Rect> found;
+        int side = std::max(1, face.width / 4);
+        for (int k = 0; k < 2; ++k) {
+            cv::Rect eye(cvRound(d[4 + 2 * k]) - face.x - side / 2,
+                         cvRound(d[5 + 2 * k]) - face.y - side / 2, side, side);
+            eye &= cv::Rect(0, 0, face.width, face.height);
+            if (eye.area() > 0) found.push_back(eye);
+        }
+        eyes->push_back(found);
+    }
+    if (params.largest_face && faces.size() > 1) {
+        faces.assign(1, faces[largest]);
+        if (eyes) eyes->assign(1, std::vector<cv::Rect>((*eyes)[largest]));
+    }
+}
+#endif
+
+bool DetectorModels::load(const std::string& face_path, const std::string& eyes_path) {
+    paths_[BACKEND_HAAR] = face_path;
+    eyes_path_ = eyes_path;
+    if (!read_file(face_path, data_[BACKEND_HAAR]) || !read_file(eyes_path, eyes_xml_)) {
+        paths_[BACKEND_HAAR].clear();
+        return false;
+    }
+    // Make sure the models actually parse before any worker relies on them
+    DetectorContext probe;
+    return init_context(probe);
+}
+
+bool DetectorModels::load_backend(DetectorBackend backend, const std::string& path) {
+    paths_[backend] = path;
+    bool ok;
+    if (backend == BACKEND_YUNET) {
+#ifdef HAVE_FACE_DETECTOR_YN
+        ok = (bool)create_yunet(path);   // read by OpenCV, per worker
+#else
+        ok = false;
+#endif
+    } else {
+        CascadeDetector probe;
+        ok = read_file(path, data_[backend]) && init_cascade(probe.cascade, data_[backend], path);
+    }
+    if (!ok) paths_[backend].clear();
+    return ok;
+}
+
+bool DetectorModels::init_context(DetectorContext& ctx) const {
+    if (!init_cascade(ctx.eyes_cascade, eyes_xml_, eyes_path_)) return false;
+    for (int b = 0; b < NUM_BACKENDS; ++b) {
+        if (!available(b)) continue;
+        if (b == BACKEND_YUNET) {
+#ifdef HAVE_FACE_DETECTOR_YN
+            cv::Ptr<cv::FaceDetectorYN> net = create_yunet(paths_[b]);
+            if (!net) return false;
+            ctx.backends[b].reset(new YunetDetector(net));
+#endif
+            continue;
+        }
+        CascadeDetector *detector = new CascadeDetector;
+        ctx.backends[b].reset(detector);
+        if (!init_cascade(detector->cascade, data_[b], paths_[b])) return false;
+    }
+    return true;
+}
+
+const cv::Mat& preprocess(const cv::Mat& image, int max_side, DetectorContext& ctx) {
+    const cv::Mat *src = &image;
+    if (image.depth() != CV_8U) {
+        // e.g. 16-bit PNG: the cascades only take 8-bit input
+        image.convertTo(ctx.gray, CV_8U, image.depth() == CV_16U ? 1.0 / 256 : 1.0);
+        src = &ctx.gray;
+    }
+    switch (src->channels()) {
+    case 3: cv::cvtColor(*src, ctx.gray, cv::COLOR_BGR2GRAY); src = &ctx.gray; break;
+    case 4: cv::cvtColor(*src, ctx.gray, cv::COLOR_BGRA2GRAY); src = &ctx.gray; break;
+    default: break;
+    }
+    int longest = std::max(src->cols, src->rows);
+    if (max_side > 0 && longest > max_side) {
+        // Shrinking the single gray channel is cheaper than the colour image
+        double f = (double)max_side / longest;
+        cv::Size size(std::max(1, cvRound(src->cols * f)), std::max(1, cvRound(src->rows * f)));
+        cv::resize(*src, ctx.small, size, 0, 0, cv::INTER_AREA);
+        src = &ctx.small;
+    }
+    cv::equalizeHist(*src, ctx.equalized);
+    return ctx.equalized;
+}
+
+const cv::Mat& preprocess_colour(const cv::Mat& image, int max_side, DetectorContext& ctx) {
+    const cv::Mat *src = &image;
+    if (image.depth() != CV_8U) {
+        image.convertTo(ctx.colour, CV_8U, image.depth() == CV_16U ? 1.0 / 256 : 1.0);
+        src = &ctx.colour;
+    }
+    switch (src->channels()) {
+    case 1: cv::cvtColor(*src, ctx.colour, cv::COLOR_GRAY2BGR); src = &ctx.colour; break;
+    case 4: cv::cvtColor(*src, ctx.colour, cv::COLOR_BGRA2BGR); src = &ctx.colour; break;
+    default: break;
+    }
+    int longest = std::max(src->cols, src->rows);
+    if (max_side > 0 && longest > max_side) {
+        double f = (double)max_side / longest;
+        cv::Size size(std::max(1, cvRound(src->cols * f)), std::max(1, cvRound(src->rows * f)));
+        cv::resize(*src, ctx.small, size, 0, 0, cv::INTER_AREA);
+        src = &ctx.small;
+    }
+    return *src;
+}
+
+void detect_eyes(const cv::Mat& gray, const cv::Rect& face, DetectorContext& ctx,
+                 std::vector<cv::Rect>& eyes) {
+    // Eyes lie in the top 60% of a frontal face and are roughly 1/8 to 1/2
+    // of its width; the rest of the face only yields false hits
+    cv::Rect upper(face.x, face.y, face.width, std::max(1, face.height * 3 / 5));
+    int lo = std::max(1, face.width / 8), hi = std::max(lo, face.width / 2);
+    ctx.eyes_cascade.detectMultiScale(gray(upper), eyes, 1.1, 3, 0, cv::Size(lo, lo), cv::Size(hi, hi));
+}
+
+void merge_duplicates(std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *eyes) {
+    // Largest first, so that each face is only compared with larger ones
+    std::vector<size_t> order(faces.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return faces[a].area() > faces[b].area(); });
+    std::vector<cv::Rect> kept;
+    std::vector<std::vector<cv::Rect>> kept_eyes;
+    for (size_t i : order) {
+        const cv::Rect& face = faces[i];
+        bool duplicate = false;
+        for (const cv::Rect& k : kept) {
+            if ((face & k).area() * 2 > face.area()) {
+                duplicate = true;
+                break;
+            }
+        }
+        if (duplicate) continue;
+        kept.push_back(face);
+        if (eyes) kept_eyes.push_back((*eyes)[i]);
+    }
+    faces.swap(kept);
+    if (eyes) eyes->swap(kept_eyes);
+}
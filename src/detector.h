@@ -0,0 +1,109 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "params.h"
+
+// cv::FaceDetectorYN (the YuNet backend) first appeared in OpenCV 4.5.4.
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 \
+        || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 4)))
+#define HAVE_FACE_DETECTOR_YN 1
+#endif
+
+// Faces found in one image and, when has_eyes is set, the eyes found in
+// each face (eyes[i] belongs to faces[i], relative to its top-left corner).
+struct Detections {
+    std::vector<cv::Rect> faces;
+    std::vector<std::vector<cv::Rect>> eyes;
+    bool has_eyes;
+
+    Detections() : has_eyes(false) {}
+};
+
+// One way of finding faces. Instances hold per-thread model state and are
+// only used by the worker that owns them.
+class FaceDetector {
+public:
+    virtual ~FaceDetector() {}
+
+    // Whether detect() takes the colour image (see preprocess_colour())
+    // rather than the equalized grayscale one (see preprocess()).
+    virtual bool wants_colour() const = 0;
+
+    // Whether detect() also locates the eyes, so no eye cascade is needed.
+    virtual bool finds_eyes() const = 0;
+
+    // Find faces in a preprocessed image with the request's tuning. `scale`
+    // is the size of that image relative to the original, whose pixels the
+    // face size bounds are given in. Faces (and, for finds_eyes() backends
+    // when `eyes` is not null, the eyes of each, relative to the face) are
+    // left in the preprocessed image's coordinates.
+    virtual void detect(const cv::Mat& input, const RequestParams& params, double scale,
+                        std::vector<cv::Rect>& faces,
+                        std::vector<std::vector<cv::Rect>> *eyes) = 0;
+};
+
+// Detection state owned by exactly one worker thread: private detector
+// instances (neither CascadeClassifier nor FaceDetectorYN is safe to share
+// between threads), indexed by DetectorBackend and null where a backend is
+// not loaded, and preprocessing buffers that are reused from one request
+// to the next.
+struct DetectorContext {
+    std::unique_ptr<FaceDetector> backends[NUM_BACKENDS];
+    cv::CascadeClassifier eyes_cascade;
+    cv::Mat gray, small, equalized, colour;
+};
+
+// Convert an image to the grayscale, histogram-equalized form both
+// cascades are run on, in ctx's buffers. Face ROIs of the result feed the
+// eye cascade, so the conversion happens once per image; drawing still
+// happens on the colour original. If max_side is not 0 and the image is
+// larger, the result is area-downscaled so its longest side is max_side;
+// detections must then be scaled back to the image.
+const cv::Mat& preprocess(const cv::Mat& image, int max_side, DetectorContext& ctx);
+
+// The same for backends that take an 8-bit BGR image.
+const cv::Mat& preprocess_colour(const cv::Mat& image, int max_side, DetectorContext& ctx);
+
+// Drop faces found twice, e.g. by neighbouring tiles of a tiled detection:
+// of two faces sharing most of the smaller one's area, only the larger is
+// kept. eyes, if not null, is kept in step with faces.
+void merge_duplicates(std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Rect>> *eyes);
+
+// Run the eye cascade on a face (a rectangle of the preprocessed image).
+// Only the upper part of the face is searched, for eyes sized in
+// proportion to it. Eyes are relative to the face's top-left corner.
+void detect_eyes(const cv::Mat& gray, const cv::Rect& face, DetectorContext& ctx,
+                 std::vector<cv::Rect>& eyes);
+
+// Detector models read from disk once at start-up. Every DetectorContext
+// is built from these in-memory copies, so adding workers costs no file
+// I/O.
+class DetectorModels {
+public:
+    // Read the Haar face and eye cascades. Returns false if either cannot
+    // be loaded. Required: every backend but YuNet uses the eye cascade.
+    bool load(const std::string& face_path, const std::string& eyes_path);
+
+    // Read an optional backend's model: the LBP face cascade or the YuNet
+    // ONNX file. Returns false if it cannot be loaded (or, for YuNet, if
+    // OpenCV is too old to run it).
+    bool load_backend(DetectorBackend backend, const std::string& path);
+
+    bool available(uint32_t backend) const {
+        return backend < NUM_BACKENDS && !paths_[backend].empty();
+    }
+
+    // Initialise a context's detectors from the loaded models.
+    bool init_context(DetectorContext& ctx) const;
+
+private:
+    std::string paths_[NUM_BACKENDS];
+    std::string data_[NUM_BACKENDS];    // XML or ONNX bytes
+    std::string eyes_path_, eyes_xml_;
+};
+
+#endif // DETECTOR_H
@@ -0,0 +1,37 @@
+// encode.cpp
+#include "encode.h"
+#include "protocol.h"
+
+bool encode_image(const cv::Mat& image, const RequestParams& params, std::vector<uchar>& out) {
+    std::vector<int> flags;
+    const char *ext;
+    switch (params.format) {
+    case FORMAT_PNG:
+        ext = ".png";
+        flags = { cv::IMWRITE_PNG_COMPRESSION, (int)params.png_level };
+        break;
+    case FORMAT_WEBP:
+        ext = ".webp";
+        flags = { cv::IMWRITE_WEBP_QUALITY, (int)params.webp_quality };
+        break;
+    default:
+        ext = ".jpg";
+        flags = { cv::IMWRITE_JPEG_QUALITY, (int)params.jpeg_quality,
+                  cv::IMWRITE_JPEG_OPTIMIZE, (params.jpeg_flags & JPEG_OPTIMIZE) ? 1 : 0,
+                  cv::IMWRITE_JPEG_PROGRESSIVE, (params.jpeg_flags & JPEG_PROGRESSIVE) ? 1 : 0 };
+        break;
+    }
+    try {
+        return cv::imencode(ext, image, out, flags);
+    } catch (const cv::Exception&) {
+        return false;   // codec missing from this OpenCV build
+    }
+}
+
+const char *format_name(uint32_t format) {
+    switch (format) {
+    case FORMAT_PNG: return "png";
+    case FORMAT_WEBP: return "webp";
+    default: return "jpeg";
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "params.h"
+
+// Encode an output image in the request's format with its quality and
+// compression settings. Returns false if OpenCV cannot encode it (e.g. it
+// was built without WebP support).
+bool encode_image(const cv::Mat& image, const RequestParams& params, std::vector<uchar>& out);
+
+// Name of an OutputFormat, as used on the command line and in statistics.
+const char *format_name(uint32_t format);
+
+#endif // ENCODE_H
@@ -0,0 +1,84 @@
+// matalloc.cpp
+#include "matalloc.h"
+#include <opencv2/opencv.hpp>
+
+BufferPool& image_buffers = *new BufferPool(0);
+std::atomic<uint64_t> small_mat_allocs{0};
+
+// Below this size malloc is as fast as the pool and wastes no memory on
+// rounding; face rectangles, kernels and the like stay there.
+static const size_t MIN_POOLED_BYTES = 64 << 10;
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag AccessFlags;
+#else
+typedef int AccessFlags;
+#endif
+
+// cv::StdMatAllocator with the data taken from image_buffers. Request
+// after request needs the same few image sizes, so after warm-up nearly
+// every matrix reuses a block freed by an earlier one instead of going
+// through malloc, which for large sizes means an mmap and a page fault
+// per page on every request. Once the pool's in-use cap is reached,
+// further matrices come from cv::fastMalloc until blocks are returned.
+class PoolMatAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data0,
+                           size_t *step, AccessFlags, cv::UMatUsageFlags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP) {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                } else {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+        uchar *data = (uchar *)data0;
+        bool pooled = false;
+        if (!data) {
+            if (total >= MIN_POOLED_BYTES) {
+                // Past the pool's in-use cap, as if pooling were off
+                data = (uchar *)image_buffers.try_allocate(total);
+                pooled = data != nullptr;
+            } else {
+                small_mat_allocs.fetch_add(1);
+            }
+            if (!data) data = (uchar *)cv::fastMalloc(total);
+        }
+        cv::UMatData *u = new cv::UMatData(this);
+        u->data = u->origdata = data;
+        u->size = total;
+        // Marks data to be given back to the pool
+        u->userdata = pooled ? &image_buffers : nullptr;
+        if (data0) u->flags |= cv::UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, AccessFlags, cv::UMatUsageFlags) const override {
+        return u != nullptr;
+    }
+
+    void deallocate(cv::UMatData *u) const override {
+        if (!u) return;
+        CV_Assert(u->urefcount == 0 && u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            if (u->userdata) {
+                image_buffers.deallocate((char *)u->origdata, u->size);
+            } else {
+                cv::fastFree(u->origdata);
+            }
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+};
+
+void install_mat_allocator() {
+    // Leaked for the same reason as image_buffers
+    static PoolMatAllocator *allocator = new PoolMatAllocator;
+    cv::Mat::setDefaultAllocator(allocator);
+}
@@ -0,0 +1,20 @@
+#ifndef MATALLOC_H
+#define MATALLOC_H
+
+#include "bufpool.h"
+#include <atomic>
+#include <stdint.h>
+
+// Pixel buffers of every cv::Mat created once install_mat_allocator() has
+// run: decoded images, grayscale and resized copies, encoder scratch.
+// Never destroyed, as matrices in static storage may outlive main().
+extern BufferPool& image_buffers;
+
+// Matrices too small to be worth pooling, served by cv::fastMalloc.
+extern std::atomic<uint64_t> small_mat_allocs;
+
+// Make OpenCV allocate matrix data from image_buffers (up to its in-use
+// cap). Call once, before any worker thread starts.
+void install_mat_allocator();
+
+#endif // MATALLOC_H
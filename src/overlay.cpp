@@ -0,0 +1,34 @@
+// overlay.cpp
+#include "overlay.h"
+#include "composite.h"
+
+bool premultiply_overlay(const cv::Mat& decoded, cv::Mat& bgra) {
+    if (decoded.empty() || decoded.depth() != CV_8U) return false;
+    switch (decoded.channels()) {
+    case 1: cv::cvtColor(decoded, bgra, cv::COLOR_GRAY2BGRA); return true;  // opaque
+    case 3: cv::cvtColor(decoded, bgra, cv::COLOR_BGR2BGRA); return true;
+    case 4: break;
+    default: return false;
+    }
+    bgra.create(decoded.size(), CV_8UC4);
+    for (int y = 0; y < decoded.rows; ++y) {
+        const uchar *s = decoded.ptr<uchar>(y);
+        uchar *d = bgra.ptr<uchar>(y);
+        for (int x = 0; x < decoded.cols; ++x, s += 4, d += 4) {
+            unsigned a = s[3];
+            // Rounded division by 255
+            d[0] = (uchar)((s[0] * a + 127) / 255);
+            d[1] = (uchar)((s[1] * a + 127) / 255);
+            d[2] = (uchar)((s[2] * a + 127) / 255);
+            d[3] = (uchar)a;
+        }
+    }
+    return true;
+}
+
+bool blend_overlay(cv::Mat& image, const cv::Rect& where, const cv::Mat& overlay) {
+    // Scaling premultiplied pixels keeps transparent edges free of fringes
+    cv::Mat resized;
+    cv::resize(overlay, resized, where.size());
+    return composite(image, where, resized, ALPHA_PREMULTIPLIED);
+}
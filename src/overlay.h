@@ -0,0 +1,30 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+#include "cache.h"
+
+// Overlay images registered by clients (OP_REGISTER_OVERLAY), kept decoded
+// so that replace requests naming them skip the upload and the decode. An
+// overlay's handle is a hash of its encoded bytes and size, keyed with a
+// secret chosen at server start-up. Least recently used overlays are
+// dropped when the byte budget is exceeded.
+typedef ShardedLru<cv::Mat> OverlayRegistry;
+
+// Registry key of a handle.
+static inline CacheKey overlay_key(uint64_t handle) {
+    CacheKey key = { handle, 0, 0, 0, 0, 0 };
+    return key;
+}
+
+// Convert a decoded image (1, 3 or 4 channels) to BGRA with the colour
+// premultiplied by alpha, the layout blend_overlay() expects. Returns
+// false for unsupported images.
+bool premultiply_overlay(const cv::Mat& decoded, cv::Mat& bgra);
+
+// Scale a premultiplied BGRA overlay to `where` and blend it onto an
+// image with composite(). Returns false if the image layout is unsupported.
+bool blend_overlay(cv::Mat& image, const cv::Rect& where, const cv::Mat& overlay);
+
+#endif // OVERLAY_H
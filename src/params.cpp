@@ -0,0 +1,89 @@
+// params.cpp
+#include "params.h"
+#include <algorithm>
+#include "cache.h"
+#include "protocol.h"
+
+uint64_t RequestParams::detection_variant() const {
+    uint32_t fields[] = { detect_size, scale_factor, min_neighbors, min_face, max_face,
+                          largest_face, backend };
+    return hash_bytes(fields, sizeof(fields));
+}
+
+uint64_t RequestParams::variant() const {
+    // Skipping eyes and encoding change the reply, not the faces:
+    // detections are shared
+    uint64_t fields[] = { detection_variant(), skip_eyes, format, jpeg_quality, jpeg_flags,
+                          png_level, webp_quality };
+    return hash_bytes(fields, sizeof(fields));
+}
+
+const char *parse_params(const unsigned char *block, size_t size, uint32_t min_face_floor,
+                         RequestParams& params) {
+    const char *p = (const char *)block;
+    const char *end = p + size;
+    uint8_t key, len;
+    const char *value;
+    while (next_param(p, end, key, value, len)) {
+        if (len != 4) return "invalid request parameters";
+        uint32_t v = get_le32(value);
+        switch (key) {
+        case PARAM_DETECT_SIZE:
+            if (v != 0 && (v < MIN_DETECT_SIZE || v > 65535)) return "invalid detection size";
+            params.detect_size = v;
+            break;
+        case PARAM_SCALE_FACTOR:
+            if (v < MIN_SCALE_FACTOR || v > MAX_SCALE_FACTOR) return "invalid scale factor";
+            params.scale_factor = v;
+            break;
+        case PARAM_MIN_NEIGHBORS:
+            if (v > MAX_MIN_NEIGHBORS) return "invalid neighbor count";
+            params.min_neighbors = v;
+            break;
+        case PARAM_MIN_FACE:
+        case PARAM_MAX_FACE:
+            if (v > MAX_FACE_SIZE) return "invalid face size";
+            if (key == PARAM_MIN_FACE) {
+                // Smaller faces mean more of the pyramid searched
+                params.min_face = std::max(v, min_face_floor);
+            } else {
+                params.max_face = v;
+            }
+            break;
+        case PARAM_LARGEST_FACE:
+        case PARAM_SKIP_EYES:
+            if (v > 1) return "invalid request parameters";
+            (key == PARAM_LARGEST_FACE ? params.largest_face : params.skip_eyes) = v;
+            break;
+        case PARAM_BACKEND:
+            if (v >= NUM_BACKENDS) return "unknown detector backend";
+            params.backend = v;
+            break;
+        case PARAM_FORMAT:
+            if (v >= NUM_FORMATS) return "unknown output format";
+            params.format = v;
+            break;
+        case PARAM_JPEG_QUALITY:
+            if (v > MAX_JPEG_QUALITY) return "invalid encoding quality";
+            params.jpeg_quality = v;
+            break;
+        case PARAM_JPEG_FLAGS:
+            if (v & ~(JPEG_OPTIMIZE | JPEG_PROGRESSIVE)) return "invalid request parameters";
+            params.jpeg_flags = v;
+            break;
+        case PARAM_PNG_LEVEL:
+            if (v > MAX_PNG_LEVEL) return "invalid encoding quality";
+            params.png_level = v;
+            break;
+        case PARAM_WEBP_QUALITY:
+            if (v < 1 || v > MAX_WEBP_QUALITY) return "invalid encoding quality";
+            params.webp_quality = v;
+            break;
+        default:
+            return "unknown request parameter";
+        }
+    }
+    if (p != end) return "invalid request parameters";
+    if (params.max_face != 0 && params.max_face < params.min_face) return "invalid face size";
+    return nullptr;
+}
@@ -0,0 +1,72 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Face detector implementations (see detector.h).
+enum DetectorBackend {
+    BACKEND_HAAR,           // Haar cascade: the most thorough
+    BACKEND_LBP,            // LBP cascade: several times faster, less accurate
+    BACKEND_YUNET,          // YuNet CNN (cv::FaceDetectorYN), with eye landmarks
+    NUM_BACKENDS
+};
+
+// Output image encodings.
+enum OutputFormat {
+    FORMAT_JPEG,
+    FORMAT_PNG,
+    FORMAT_WEBP,
+    NUM_FORMATS
+};
+
+// Options that shape how a request is processed: the server defaults, set
+// on the command line, overridden per request by its parameter block (see
+// OP_FLAG_PARAMS in protocol.h).
+struct RequestParams {
+    uint32_t detect_size;   // longest image side detection runs at (0 = full size)
+    uint32_t scale_factor;  // face cascade scale step, in thousandths
+    uint32_t min_neighbors; // face cascade hits needed per face
+    uint32_t min_face;      // face width bounds in image pixels (0 = none)
+    uint32_t max_face;
+    uint32_t largest_face;  // 1 = only the largest face, found coarse to fine
+    uint32_t skip_eyes;     // 1 = no eye search
+    uint32_t backend;       // a DetectorBackend
+    uint32_t format;        // an OutputFormat
+    uint32_t jpeg_quality;
+    uint32_t jpeg_flags;    // JPEG_OPTIMIZE, JPEG_PROGRESSIVE (protocol.h)
+    uint32_t png_level;
+    uint32_t webp_quality;  // above 100: lossless
+
+    // The face search and encoding defaults are OpenCV's own
+    RequestParams()
+        : detect_size(0), scale_factor(1100), min_neighbors(3), min_face(0), max_face(0),
+          largest_face(0), skip_eyes(0), backend(BACKEND_HAAR), format(FORMAT_JPEG),
+          jpeg_quality(95), jpeg_flags(0), png_level(1), webp_quality(101) {}
+
+    // Hashes of the fields that change the faces and eyes found, and of
+    // every field (all of which change the reply), for cache keys.
+    uint64_t detection_variant() const;
+    uint64_t variant() const;
+};
+
+// Bounds the server enforces on request parameters. A finer scale step
+// or a smaller minimum face makes detection slower; the neighbour count
+// only changes how hits are grouped, not the search. The minimum face
+// width has a floor set when the server starts (see parse_params()).
+#define MIN_DETECT_SIZE   32    // other than 0
+#define MIN_SCALE_FACTOR  1050
+#define MAX_SCALE_FACTOR  2000
+#define MAX_MIN_NEIGHBORS 16
+#define MAX_FACE_SIZE     65535
+#define MAX_JPEG_QUALITY  100
+#define MAX_PNG_LEVEL     9
+#define MAX_WEBP_QUALITY  101
+
+// Apply a request's parameter block on top of `params`. A minimum face
+// width below min_face_floor (the server's --minface) is raised to it.
+// Returns null on success, else the error message for the client.
+const char *parse_params(const unsigned char *block, size_t size, uint32_t min_face_floor,
+                         RequestParams& params);
+
+#endif // PARAMS_H
@@ -0,0 +1,38 @@
+// pipeline.cpp
+#include "pipeline.h"
+#include <chrono>
+
+// Microseconds elapsed since t0.
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+}
+
+Stage::Stage(const char *name, unsigned nthreads, size_t capacity)
+    : name_(name), capacity_(capacity), pool_(nthreads) {}
+
+void Stage::push(WorkerPool::Task work, Then then) {
+    size_t depth;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return capacity_ == 0 || depth_ < capacity_; });
+        depth = ++depth_;
+    }
+    size_t peak = peak_.load();
+    while (depth > peak && !peak_.compare_exchange_weak(peak, depth)) {
+    }
+    auto queued = std::chrono::steady_clock::now();
+    pool_.submit([this, work, then, queued](unsigned worker) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --depth_;
+        }
+        not_full_.notify_one();
+        wait_us_.fetch_add(elapsed_us(queued));
+        auto started = std::chrono::steady_clock::now();
+        work(worker);
+        service_us_.fetch_add(elapsed_us(started));
+        processed_.fetch_add(1);
+        then();
+    });
+}
@@ -0,0 +1,49 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "workerpool.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+// One stage of a processing pipeline: a WorkerPool of its own, fed through
+// a bounded queue. While the queue is full push() waits, so a slow stage
+// holds up the stages feeding it rather than letting work pile up in
+// between. Queue depth, waiting time and service time are kept per stage.
+class Stage {
+public:
+    typedef std::function<void()> Then;
+
+    // capacity 0 = unbounded (the caller limits what it pushes).
+    Stage(const char *name, unsigned nthreads, size_t capacity);
+
+    // Queue `work`. Once a worker has run work(worker), the time counted
+    // as service, it runs `then` (typically pushing to the next stage).
+    void push(WorkerPool::Task work, Then then);
+
+    WorkerPool& pool() { return pool_; }
+    const char *name() const { return name_; }
+    unsigned threads() const { return pool_.size(); }
+
+    // Tasks waiting now, and the most there have been.
+    size_t depth() const { return depth_.load(); }
+    size_t peak() const { return peak_.load(); }
+    // Tasks run, and their total time waiting and being served.
+    uint64_t processed() const { return processed_.load(); }
+    uint64_t wait_us() const { return wait_us_.load(); }
+    uint64_t service_us() const { return service_us_.load(); }
+
+private:
+    const char *name_;
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::atomic<size_t> depth_{0}, peak_{0};
+    std::atomic<uint64_t> processed_{0}, wait_us_{0}, service_us_{0};
+    WorkerPool pool_;   // last, so its threads stop before the rest goes
+};
+
+#endif // PIPELINE_H
@@ -2,6 +2,9 @@
 #include "protocol.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
 
 bool send_all(int sockfd, const char *buf, size_t len) {
     size_t total = 0;
@@ -22,3 +25,268 @@ bool recv_all(int sockfd, char *buf, size_t len) {
     }
     return true;
 }
+
+bool send_iov(int sockfd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        // Skip over what was written, including any zero-length entries
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+void make_frame_header(char *hdr, char op, uint32_t len) {
+    put_le32(hdr, PROTOCOL_PREFIX);
+    hdr[4] = op;
+    put_le32(hdr + 5, len);
+}
+
+void make_tagged_frame_header(char *hdr, char op, uint32_t request_id, uint32_t len) {
+    put_le32(hdr, PROTOCOL_PREFIX);
+    hdr[4] = op | OP_FLAG_TAGGED;
+    put_le32(hdr + 5, request_id);
+    put_le32(hdr + 9, len);
+}
+
+bool send_frame(int sockfd, char op, const void *payload, uint32_t len) {
+    char hdr[FRAME_HEADER_SIZE];
+    make_frame_header(hdr, op, len);
+    iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = const_cast<void *>(payload);
+    iov[1].iov_len = len;
+    return send_iov(sockfd, iov, 2);
+}
+
+// Number of length-prefixed payloads carried by op, or -1 if op may not be
+// sent in this direction.
+static int frame_parts(char op, bool from_client) {
+    if (from_client) {
+        switch (op) {
+        case OP_FACE_DETECT:  return 1;
+        case OP_FACE_REPLACE: return 2;
+        case OP_FACE_RECTS:   return 1;
+        case OP_BATCH_REQUEST: return 1;
+        case OP_REGISTER_OVERLAY: return 1;
+        case OP_FACE_REPLACE_HANDLE: return 2;
+        default:              return -1;
+        }
+    }
+    switch (op) {
+    case OP_OUTPUT_IMAGE:
+    case OP_ERROR_MESSAGE:
+    case OP_SERVER_BUSY:
+    case OP_DETECTIONS:
+    case OP_BATCH_RESPONSE:
+    case OP_OVERLAY_HANDLE:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+FrameStatus parse_frame(const char *buf, size_t len, uint32_t maxsize, uint32_t maxbatch,
+                        bool from_client, FrameInfo& info) {
+    info.nparts = 0;
+    info.error = nullptr;
+
+    info.total = 4;
+    if (len < info.total) return FRAME_INCOMPLETE;
+    if (get_le32(buf) != PROTOCOL_PREFIX) return FRAME_INVALID;
+
+    info.total = 5;
+    if (len < info.total) return FRAME_INCOMPLETE;
+    char flags = from_client ? (OP_FLAG_TAGGED | OP_FLAG_PARAMS) : OP_FLAG_TAGGED;
+    info.op = buf[4] & ~flags;
+    info.tagged = (buf[4] & OP_FLAG_TAGGED) != 0;
+    info.request_id = 0;
+    info.params_offset = 0;
+    info.params_size = 0;
+    size_t off = 5;
+    if (info.tagged) {
+        info.total = off + 4;
+        if (len < info.total) return FRAME_INCOMPLETE;
+        info.request_id = get_le32(buf + off);
+        off += 4;
+    }
+    if (buf[4] & flags & OP_FLAG_PARAMS) {
+        info.total = off + 4;
+        if (len < info.total) return FRAME_INCOMPLETE;
+        info.params_size = get_le32(buf + off);
+        if (info.params_size == 0 || info.params_size > MAX_PARAMS_SIZE) {
+            info.error = "invalid request parameters";
+            return FRAME_ERROR;
+        }
+        info.params_offset = off + 4;
+        off += 4 + info.params_size;
+    }
+    int nparts = frame_parts(info.op, from_client);
+    if (nparts < 0) {
+        info.error = "invalid operation type";
+        return FRAME_ERROR;
+    }
+
+    for (int i = 0; i < nparts; ++i) {
+        info.total = off + 4;
+        if (len < info.total) return FRAME_INCOMPLETE;
+        uint32_t size = get_le32(buf + off);
+        if (from_client) {
+            if (info.op == OP_BATCH_REQUEST) {
+                // Items are checked individually once the batch arrives
+                if (maxbatch != 0 && size > maxbatch) {
+                    info.error = "batch too large";
+                    return FRAME_ERROR;
+                }
+            } else if (info.op == OP_FACE_REPLACE_HANDLE && i == 1) {
+                if (size != OVERLAY_HANDLE_SIZE) {
+                    info.error = "invalid overlay handle";
+                    return FRAME_ERROR;
+                }
+            } else if (size == 0) {
+                info.error = "image is 0 bytes";
+                return FRAME_ERROR;
+            } else if (maxsize != 0 && size > maxsize) {
+                info.error = "image too large";
+                return FRAME_ERROR;
+            }
+        }
+        info.offset[i] = off + 4;
+        info.size[i] = size;
+        info.nparts = i + 1;
+        off = info.total + size;
+    }
+    info.total = off;
+    return len < info.total ? FRAME_INCOMPLETE : FRAME_COMPLETE;
+}
+
+void append_param(std::vector<char>& block, uint8_t key, uint32_t value) {
+    char entry[6];
+    entry[0] = (char)key;
+    entry[1] = 4;
+    put_le32(entry + 2, value);
+    block.insert(block.end(), entry, entry + sizeof(entry));
+}
+
+bool next_param(const char *&p, const char *end, uint8_t& key,
+                const char *&value, uint8_t& size) {
+    if (end - p < 2) return false;
+    key = (uint8_t)p[0];
+    size = (uint8_t)p[1];
+    if (end - p - 2 < size) return false;
+    value = p + 2;
+    p += 2 + size;
+    return true;
+}
+
+// Smallest read attempted by FrameReader::fill().
+static const size_t READ_AHEAD = 64 * 1024;
+
+// Room to make after `have` buffered bytes of a message `total` bytes
+// long (as far as known): the rest of it, but no more than doubling what
+// has arrived, so a client must send the bytes it claims before the
+// buffer grows to hold them.
+static size_t read_room(size_t have, size_t total) {
+    size_t step = std::max(READ_AHEAD, have);
+    return total > have ? std::min(total - have, step) : READ_AHEAD;
+}
+
+ssize_t FrameReader::fill(int fd) {
+    FrameInfo info;
+    size_t have = buffered();
+    size_t want = READ_AHEAD;
+    if (peek(info) == FRAME_INCOMPLETE) want = std::max(want, read_room(have, info.total));
+    if (have == 0) {
+        // Idle: go through a scratch buffer so a connection that received
+        // only a few bytes does not pin a READ_AHEAD-sized allocation.
+        static thread_local std::vector<char> scratch(READ_AHEAD);
+        ssize_t n = recv(fd, scratch.data(), READ_AHEAD, 0);
+        if (n > 0) {
+            // Room for more of the message if its lengths have arrived
+            size_t size = n;
+            if (parse_frame(scratch.data(), n, maxsize_, maxbatch_, from_client_, info)
+                    == FRAME_INCOMPLETE) {
+                size += read_room(n, info.total);
+            }
+            buf_ = receive_buffers.acquire(size);
+            memcpy(buf_.data(), scratch.data(), n);
+            len_ = n;
+            start_ = 0;
+        }
+        return n;
+    }
+    if (start_ + have + want > buf_.capacity()) {
+        if (have + want <= buf_.capacity()) {
+            // Mostly consumed already: compact instead of growing
+            memmove(buf_.data(), buf_.data() + start_, have);
+            len_ = have;
+            start_ = 0;
+        } else {
+            grow(have + want);
+        }
+    }
+    // Whatever fits: the buffer's size class may leave more than asked for
+    ssize_t n = recv(fd, buf_.data() + len_, buf_.capacity() - len_, 0);
+    if (n > 0) len_ += n;
+    return n;
+}
+
+void FrameReader::grow(size_t size) {
+    PooledBuffer bigger = receive_buffers.acquire(size);
+    memcpy(bigger.data(), data(), buffered());
+    len_ = buffered();
+    start_ = 0;
+    buf_ = std::move(bigger);
+}
+
+bool FrameReader::read_frame(int fd, FrameInfo& info, FrameStatus& status) {
+    while ((status = peek(info)) == FRAME_INCOMPLETE) {
+        ssize_t n = fill(fd);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+    }
+    return true;
+}
+
+void FrameReader::consume(size_t n) {
+    start_ += n;
+    if (start_ >= len_) {
+        // Nothing left: give the memory back while the connection idles
+        buf_.reset();
+        len_ = 0;
+        start_ = 0;
+    }
+}
+
+PooledBuffer FrameReader::take(size_t n) {
+    size_t rest = buffered() - n;
+    PooledBuffer out;
+    if (start_ == 0 && rest <= n) {
+        // Hand the buffer over; only the (smaller) rest is copied
+        out = std::move(buf_);
+        if (rest > 0) {
+            buf_ = receive_buffers.acquire(rest);
+            memcpy(buf_.data(), out.data() + n, rest);
+        }
+        len_ = rest;
+        start_ = 0;
+    } else {
+        out = receive_buffers.acquire(n);
+        memcpy(out.data(), data(), n);
+        consume(n);
+    }
+    return out;
+}
@@ -3,12 +3,84 @@
 
 #include <stdint.h>   // For uint32_t, uint8_t
 #include <stddef.h>
+#include <sys/types.h> // For ssize_t
+#include <sys/uio.h>  // For struct iovec
+#include <vector>
+#include "bufpool.h"
 
 static const uint32_t PROTOCOL_PREFIX = 0x23107231U;
 #define OP_FACE_DETECT    0  // Client -> Server
 #define OP_FACE_REPLACE   1  // Client -> Server
 #define OP_OUTPUT_IMAGE   2  // Server -> Client
 #define OP_ERROR_MESSAGE  3  // Server -> Client
+#define OP_SERVER_BUSY    4  // Server -> Client: 4-byte retry-after (ms) + message
+#define OP_FACE_RECTS     5  // Client -> Server: detect, reply with rectangles only
+#define OP_DETECTIONS     6  // Server -> Client: face/eye rectangles (see below)
+#define OP_BATCH_REQUEST  7  // Client -> Server: several requests in one message
+#define OP_BATCH_RESPONSE 8  // Server -> Client: one result per batch item
+#define OP_REGISTER_OVERLAY 9      // Client -> Server: keep an overlay image
+#define OP_OVERLAY_HANDLE   10     // Server -> Client: handle of a kept overlay
+#define OP_FACE_REPLACE_HANDLE 11  // Client -> Server: replace with a kept overlay
+
+// Set on a request opcode to tag it with a 32-bit request ID, which follows
+// the op byte. Tagged requests may be pipelined: the server keeps reading
+// and processing them while earlier ones are in progress, and answers each
+// as soon as it is done, in any order. The reply opcode carries the same
+// flag, followed by the echoed ID and then the usual length and payload.
+#define OP_FLAG_TAGGED    0x80
+
+// Set on a request opcode when a parameter block follows the op byte (and
+// request ID, if tagged): a 32-bit length, then entries of key (1 byte),
+// value length (1 byte) and value, before the usual length-prefixed
+// parts. Parameters of a batch request apply to every item.
+#define OP_FLAG_PARAMS    0x40
+#define MAX_PARAMS_SIZE   256
+
+// Request parameter keys. Values are 32-bit little-endian unless noted.
+#define PARAM_DETECT_SIZE   1  // longest image side to detect at (0 = full size)
+#define PARAM_SCALE_FACTOR  2  // face search scale step, in thousandths
+#define PARAM_MIN_NEIGHBORS 3  // overlapping hits needed to report a face
+#define PARAM_MIN_FACE      4  // smallest face width in image pixels (0 = any)
+#define PARAM_MAX_FACE      5  // largest face width in image pixels (0 = any)
+#define PARAM_LARGEST_FACE  6  // 1 = coarse search for the largest face only
+#define PARAM_SKIP_EYES     7  // 1 = faces only, no eye search
+#define PARAM_BACKEND       8  // face detector: 0 = Haar, 1 = LBP, 2 = YuNet
+#define PARAM_FORMAT        9  // output image: 0 = JPEG, 1 = PNG, 2 = WebP
+#define PARAM_JPEG_QUALITY 10  // 0-100
+#define PARAM_JPEG_FLAGS   11  // JPEG_OPTIMIZE | JPEG_PROGRESSIVE
+#define PARAM_PNG_LEVEL    12  // zlib level, 0-9
+#define PARAM_WEBP_QUALITY 13  // 1-100, or 101 for lossless
+
+#define JPEG_OPTIMIZE     1     // optimized Huffman tables
+#define JPEG_PROGRESSIVE  2
+
+// Most items accepted in one OP_BATCH_REQUEST.
+#define MAX_BATCH_ITEMS 256
+
+// OP_DETECTIONS payload, all fields 32-bit little-endian:
+//   face count, then per face: x, y, width, height, eye count,
+//   then per eye: x, y, width, height.
+// Coordinates are in pixels of the submitted image.
+//
+// OP_BATCH_REQUEST payload: item count (32-bit), then per item its opcode
+// (1 byte: OP_FACE_DETECT, OP_FACE_REPLACE, OP_FACE_RECTS or
+// OP_FACE_REPLACE_HANDLE) followed by that request's length-prefixed parts.
+// OP_BATCH_RESPONSE payload: item count (32-bit), then per item, in request
+// order, a reply opcode (1 byte), a 32-bit length and the reply payload.
+//
+// OP_REGISTER_OVERLAY carries one image; the server decodes it once, keeps
+// it and answers OP_OVERLAY_HANDLE with a 64-bit handle (the same image
+// gets the same handle until the server restarts; handles cannot be
+// derived from the image alone). OP_FACE_REPLACE_HANDLE carries image1 and,
+// in place of the overlay image, a part holding the 8-byte handle. A handle
+// the server no longer knows is answered with an error and the connection
+// stays open, so the client can register the overlay again.
+#define OVERLAY_HANDLE_SIZE 8
+
+// Size of the fixed part of every message: prefix, op and first length.
+#define FRAME_HEADER_SIZE 9
+// The same for a tagged message, which also carries the request ID.
+#define TAGGED_HEADER_SIZE 13
 
 // Send all bytes in buffer, return true on success.
 bool send_all(int sockfd, const char *buf, size_t len);
@@ -16,4 +88,139 @@ bool send_all(int sockfd, const char *buf, size_t len);
 // Receive exactly len bytes into buf, return true on success (false on error/EOF).
 bool recv_all(int sockfd, char *buf, size_t len);
 
+// Send every byte described by iov with as few sendmsg() calls as the socket
+// allows (one, unless the send buffer fills). iov is modified to track
+// progress. Return true on success.
+bool send_iov(int sockfd, struct iovec *iov, int iovcnt);
+
+// Send one complete message (header and payload) in a single call.
+bool send_frame(int sockfd, char op, const void *payload, uint32_t len);
+
+// Fill in the FRAME_HEADER_SIZE-byte header: prefix, op and 32-bit length.
+void make_frame_header(char *hdr, char op, uint32_t len);
+
+// Fill in the TAGGED_HEADER_SIZE-byte header of a tagged message: prefix,
+// op with OP_FLAG_TAGGED set, request ID and 32-bit length.
+void make_tagged_frame_header(char *hdr, char op, uint32_t request_id, uint32_t len);
+
+// Outcome of looking for a message at the front of a buffer.
+enum FrameStatus {
+    FRAME_INCOMPLETE,   // more bytes needed
+    FRAME_COMPLETE,     // a whole message is buffered
+    FRAME_ERROR,        // request must be rejected with FrameInfo::error
+    FRAME_INVALID       // wrong prefix: not speaking this protocol
+};
+
+// Most length-prefixed payloads carried by one message.
+#define FRAME_MAX_PARTS 2
+
+// Layout of a message found by parse_frame(). Offsets are relative to the
+// start of the message.
+struct FrameInfo {
+    char op;                            // without OP_FLAG_TAGGED
+    bool tagged;                        // request ID present
+    uint32_t request_id;
+    size_t params_offset;               // parameter block (OP_FLAG_PARAMS)
+    uint32_t params_size;               // 0 if absent
+    int nparts;                         // payloads present
+    size_t offset[FRAME_MAX_PARTS];     // where each payload starts
+    uint32_t size[FRAME_MAX_PARTS];     // and its length
+    size_t total;                       // message length (so far as known)
+    const char *error;                  // set for FRAME_ERROR
+};
+
+// Examine len bytes at buf for one message. Header fields are validated as
+// soon as they arrive, so an oversized or empty image is rejected before
+// its payload is read. from_client selects which opcodes are acceptable and
+// whether request limits (non-empty images no larger than maxsize, batch
+// payloads no larger than maxbatch, 0 = no limit) apply. For
+// FRAME_INCOMPLETE, info.total is the number of bytes known to be needed
+// so far.
+FrameStatus parse_frame(const char *buf, size_t len, uint32_t maxsize, uint32_t maxbatch,
+                        bool from_client, FrameInfo& info);
+
+// Per-connection read-ahead buffer that assembles whole messages. Each
+// fill() is a single recv() sized to take in the header and as much of the
+// payload as is available, instead of separate reads for prefix, op,
+// lengths and data. The buffer grows with the bytes that have actually
+// arrived (at most doubling per recv), never with a length a message
+// merely claims, so a header alone cannot make it allocate much.
+// Buffers come from receive_buffers, uninitialized and reused.
+class FrameReader {
+public:
+    FrameReader(uint32_t maxsize, uint32_t maxbatch, bool from_client)
+        : maxsize_(maxsize), maxbatch_(maxbatch), from_client_(from_client), len_(0), start_(0) {}
+
+    // One recv() from fd into the buffer; returns what recv() returned.
+    ssize_t fill(int fd);
+
+    // Look for a complete message at the front of the buffer. On
+    // FRAME_COMPLETE, payload i is at data() + info.offset[i].
+    FrameStatus peek(FrameInfo& info) const {
+        return parse_frame(data(), buffered(), maxsize_, maxbatch_, from_client_, info);
+    }
+
+    // Blocking read of the next message: fill() until peek() stops
+    // returning FRAME_INCOMPLETE. Returns false on EOF or socket error.
+    bool read_frame(int fd, FrameInfo& info, FrameStatus& status);
+
+    // Drop n bytes (normally info.total) from the front of the buffer.
+    void consume(size_t n);
+
+    // Remove the first n bytes (normally info.total) and return a buffer
+    // starting with them. The receive buffer itself is handed over when
+    // little else is in it, so a large message is not copied.
+    PooledBuffer take(size_t n);
+
+    const char *data() const { return buf_.data() + start_; }
+    size_t buffered() const { return len_ - start_; }
+
+private:
+    // Make room for `size` unconsumed bytes, moving them to the front of
+    // a larger pooled buffer.
+    void grow(size_t size);
+
+    uint32_t maxsize_;
+    uint32_t maxbatch_;
+    bool from_client_;
+    PooledBuffer buf_;          // from receive_buffers
+    size_t len_;                // bytes received into buf_
+    size_t start_;              // first unconsumed byte in buf_
+};
+
+// Append a 32-bit parameter entry to a parameter block.
+void append_param(std::vector<char>& block, uint8_t key, uint32_t value);
+
+// Step through a parameter block: fetch the entry at p and advance p.
+// Returns false at the end of the block or if the entry is truncated
+// (then p != end).
+bool next_param(const char *&p, const char *end, uint8_t& key,
+                const char *&value, uint8_t& size);
+
+// Decode a little-endian 32-bit value from 4 bytes.
+static inline uint32_t get_le32(const char *p) {
+    return (uint32_t)(uint8_t)p[0]
+         | (uint32_t)(uint8_t)p[1] << 8
+         | (uint32_t)(uint8_t)p[2] << 16
+         | (uint32_t)(uint8_t)p[3] << 24;
+}
+
+// Encode a 32-bit value as 4 little-endian bytes.
+static inline void put_le32(char *p, uint32_t v) {
+    p[0] = (char)(v & 0xFF);
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+// The same for 64-bit values.
+static inline uint64_t get_le64(const char *p) {
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static inline void put_le64(char *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
 #endif // PROTOCOL_H
@@ -0,0 +1,476 @@
+// reactor.cpp
+// epoll-based network loop for uqfacedetect.
+
+#include "reactor.h"
+#include "protocol.h"
+#include "stats.h"
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#else
+#define HAVE_ZEROCOPY 0
+#endif
+
+// epoll user data for the two non-client descriptors; clients start after.
+static const uint64_t LISTEN_ID = 0;
+static const uint64_t WAKE_ID   = 1;
+
+// Most iovec entries gathered into one sendmsg() call.
+static const int MAX_IOV = 64;
+
+// Most tagged requests a connection may have in progress or awaiting send
+// before the reactor stops reading from it.
+static const size_t MAX_INFLIGHT = 64;
+
+Reactor::Reactor(int listen_fd, int connectionlimit, uint32_t maxsize, uint32_t maxbatch)
+    : listen_fd_(listen_fd), connectionlimit_(connectionlimit),
+      maxsize_(maxsize), maxbatch_(maxbatch), zerocopy_min_(0), epoll_fd_(-1), wake_fd_(-1), next_id_(WAKE_ID + 1),
+      on_request_(nullptr) {
+}
+
+Reactor::~Reactor() {
+    for (auto& kv : conns_) close(kv.second.fd);
+    if (wake_fd_ >= 0) close(wake_fd_);
+    if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+bool Reactor::init() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) return false;
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) return false;
+    int flags = fcntl(listen_fd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_ID;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) return false;
+    ev.data.u64 = WAKE_ID;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0) return false;
+    return true;
+}
+
+bool Reactor::set_zerocopy(size_t min_bytes) {
+    if (min_bytes > 0 && !HAVE_ZEROCOPY) return false;
+    zerocopy_min_ = min_bytes;
+    return true;
+}
+
+void Reactor::run(const RequestHandler& on_request) {
+    on_request_ = &on_request;
+    epoll_event events[256];
+    while (true) {
+        int n = epoll_wait(epoll_fd_, events, 256, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                accept_clients();
+            } else if (id == WAKE_ID) {
+                drain_responses();
+            } else {
+                handle_event(id, events[i].events);
+            }
+        }
+    }
+    on_request_ = nullptr;
+}
+
+void Reactor::post_response(uint64_t conn_id, Response&& resp) {
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(done_mutex_);
+        wake = done_.empty();
+        done_.emplace_back(conn_id, std::move(resp));
+    }
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t r = write(wake_fd_, &one, sizeof(one));
+        (void)r; // counter saturation is harmless: the loop is already awake
+    }
+}
+
+void Reactor::stop_reading(uint64_t conn_id) {
+    auto it = conns_.find(conn_id);
+    if (it != conns_.end()) it->second.closing = true;
+}
+
+void Reactor::accept_clients() {
+    while (true) {
+        int client_fd = accept4(listen_fd_, nullptr, nullptr,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            // EAGAIN: backlog drained. Anything else (e.g. EMFILE) is
+            // retried on the next wakeup.
+            return;
+        }
+        // Connection limiting: tell the client to back off rather than
+        // just closing, which clients treat as an error and retry at once.
+        if (connectionlimit_ > 0 && active_clients.load() >= connectionlimit_) {
+            reject_busy(client_fd);
+            continue;
+        }
+        // Replies go out in a single sendmsg(), so there is nothing for
+        // Nagle to coalesce; don't hold back the final partial segment.
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#if HAVE_ZEROCOPY
+        if (zerocopy_min_ > 0) {
+            setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+        }
+#endif
+        uint64_t id = next_id_++;
+        Connection& c = conns_.emplace(id, Connection(client_fd, maxsize_, maxbatch_)).first->second;
+        c.events = EPOLLIN | EPOLLRDHUP;
+        epoll_event ev = {};
+        ev.events = c.events;
+        ev.data.u64 = id;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close(client_fd);
+            conns_.erase(id);
+            continue;
+        }
+        active_clients.fetch_add(1);
+    }
+}
+
+void Reactor::reject_busy(int fd) {
+    static const char msg[] = "server busy";
+    char frame[FRAME_HEADER_SIZE + 4 + sizeof(msg) - 1];
+    put_le32(frame, PROTOCOL_PREFIX);
+    frame[4] = OP_SERVER_BUSY;
+    put_le32(frame + 5, 4 + sizeof(msg) - 1);
+    put_le32(frame + FRAME_HEADER_SIZE, retry_after_hint_ms.load());
+    memcpy(frame + FRAME_HEADER_SIZE + 4, msg, sizeof(msg) - 1);
+    // A fresh socket's send buffer always has room for this
+    ssize_t n = send(fd, frame, sizeof(frame), MSG_NOSIGNAL);
+    // Discard anything the client already sent: closing with unread data
+    // would reset the connection and could lose the reply.
+    char discard[4096];
+    while (n > 0) n = recv(fd, discard, sizeof(discard), 0);
+    close(fd);
+    busy_connections.fetch_add(1);
+}
+
+void Reactor::drain_responses() {
+    uint64_t count;
+    ssize_t r = read(wake_fd_, &count, sizeof(count));
+    (void)r;
+
+    std::vector<std::pair<uint64_t, Response>> done;
+    {
+        std::lock_guard<std::mutex> lock(done_mutex_);
+        done.swap(done_);
+    }
+    for (auto& item : done) {
+        auto it = conns_.find(item.first);
+        if (it == conns_.end()) continue; // client went away meanwhile
+        Connection& c = it->second;
+        Response& resp = item.second;
+        if (resp.tagged) {
+            --c.inflight;
+        } else {
+            c.busy = false;
+        }
+        if (resp.close_after) c.closing = true;
+        queue_reply(c, resp.opcode, resp.tagged, resp.request_id, std::move(resp.payload));
+        flush_output(item.first, c);
+    }
+}
+
+void Reactor::handle_event(uint64_t id, uint32_t events) {
+    auto it = conns_.find(id);
+    if (it == conns_.end()) return; // closed earlier in this batch
+    Connection& c = it->second;
+
+    if (events & EPOLLHUP) {
+        close_connection(id);
+        return;
+    }
+    if (events & EPOLLERR) {
+        // With zero-copy enabled EPOLLERR also signals send completions
+        if (!read_completions(c)) {
+            close_connection(id);
+            return;
+        }
+        if (c.closing && !finish_output(id, c)) return;
+    }
+    if (events & EPOLLOUT) {
+        if (!flush_output(id, c)) return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        if (!read_input(id, c)) return;
+        process_input(id, c);
+    }
+}
+
+// Returns false if the connection was closed.
+bool Reactor::read_input(uint64_t id, Connection& c) {
+    if (!accepting(c)) {
+        update_interest(id, c);
+        return true;
+    }
+    ssize_t n = c.in.fill(c.fd);
+    if (n > 0) return true;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return true;
+    }
+    if (n == 0 && (c.busy || c.inflight > 0 || !c.out.empty())) {
+        // The client has finished sending; deliver what it is still owed
+        // (e.g. a pipeline ending in shutdown(SHUT_WR)) before closing.
+        c.closing = true;
+        update_interest(id, c);
+        return true;
+    }
+    // EOF or error. Any partial frame is discarded.
+    close_connection(id);
+    return false;
+}
+
+// Parse and dispatch buffered requests. Returns false if the connection
+// was closed.
+bool Reactor::process_input(uint64_t id, Connection& c) {
+    while (accepting(c)) {
+        FrameInfo info;
+        FrameStatus status = c.in.peek(info);
+        if (status == FRAME_INCOMPLETE) break;
+        if (status == FRAME_INVALID) {
+            invalid_requests.fetch_add(1);
+            close_connection(id);
+            return false;
+        }
+        if (status == FRAME_ERROR) {
+            // Tagged in-flight requests still get their replies first
+            c.closing = true;
+            queue_reply(c, OP_ERROR_MESSAGE, info.tagged, info.request_id,
+                        std::vector<unsigned char>(info.error, info.error + strlen(info.error)));
+            return flush_output(id, c);
+        }
+        Request req;
+        req.conn_id = id;
+        req.opcode = info.op;
+        req.tagged = info.tagged;
+        req.request_id = info.request_id;
+        req.frame = c.in.take(info.total);
+        const char *base = req.frame.data();
+        req.params = ByteSpan(base + info.params_offset, info.params_size);
+        req.img1 = ByteSpan(base + info.offset[0], info.size[0]);
+        if (info.nparts > 1) req.img2 = ByteSpan(base + info.offset[1], info.size[1]);
+        if (req.tagged) {
+            ++c.inflight;
+        } else {
+            c.busy = true;
+        }
+        (*on_request_)(std::move(req));
+    }
+    update_interest(id, c);
+    return true;
+}
+
+// Whether more requests may be read from the connection.
+bool Reactor::accepting(const Connection& c) const {
+    return !c.busy && !c.closing && c.inflight + c.out.size() < MAX_INFLIGHT;
+}
+
+// Write as much pending output as the socket takes, gathering the headers
+// and payloads of queued replies into as few sendmsg() calls as possible.
+// Returns false if the connection was closed.
+bool Reactor::flush_output(uint64_t id, Connection& c) {
+    while (!c.out.empty()) {
+        // Zero-copy and ordinary frames are never mixed in one call
+        bool zc = c.out.front().zerocopy;
+        iovec iov[MAX_IOV];
+        int n = 0;
+        for (auto& f : c.out) {
+            if (f.zerocopy != zc || n + 2 > MAX_IOV) break;
+            size_t hsize = f.header.size();
+            if (f.sent < hsize) {
+                iov[n].iov_base = f.header.data() + f.sent;
+                iov[n].iov_len = hsize - f.sent;
+                ++n;
+            }
+            size_t body_sent = f.sent > hsize ? f.sent - hsize : 0;
+            if (body_sent < f.payload.size()) {
+                iov[n].iov_base = f.payload.data() + body_sent;
+                iov[n].iov_len = f.payload.size() - body_sent;
+                ++n;
+            }
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        int flags = MSG_NOSIGNAL;
+#if HAVE_ZEROCOPY
+        if (zc) flags |= MSG_ZEROCOPY;
+#endif
+        ssize_t w = sendmsg(c.fd, &msg, flags);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                update_interest(id, c);
+                return true;
+            }
+            if (zc && errno == ENOBUFS) {
+                // Out of pinned-page budget: send these frames normally
+                for (auto& f : c.out) {
+                    if (!f.zerocopy) break;
+                    if (f.sent > 0) {
+                        // Partly sent by reference: the kernel may still
+                        // read the original buffers until the last
+                        // zero-copy send completes, so they wait for that
+                        // and the rest goes out from a copy
+                        ZeroCopyPending p;
+                        p.seq = c.zc_next - 1;
+                        p.header.swap(f.header);
+                        p.payload.swap(f.payload);
+                        f.header = p.header;
+                        f.payload = p.payload;
+                        c.zc_pending.push_back(std::move(p));
+                    }
+                    f.zerocopy = false;
+                }
+                continue;
+            }
+            close_connection(id);
+            return false;
+        }
+        uint32_t seq = zc ? c.zc_next++ : 0;
+        if (zc) zerocopy_sends.fetch_add(1);
+
+        // Retire fully written frames
+        size_t left = w;
+        while (!c.out.empty()) {
+            OutFrame& f = c.out.front();
+            size_t total = f.header.size() + f.payload.size();
+            size_t take = std::min(left, total - f.sent);
+            f.sent += take;
+            left -= take;
+            if (f.sent < total) break;
+            if (f.zerocopy) {
+                // Moving the vectors keeps their buffers where the kernel
+                // expects them
+                ZeroCopyPending p;
+                p.seq = seq;
+                p.header.swap(f.header);
+                p.payload.swap(f.payload);
+                c.zc_pending.push_back(std::move(p));
+            }
+            c.out.pop_front();
+        }
+    }
+    update_interest(id, c);
+    return finish_output(id, c);
+}
+
+// Called once all queued output has been handed to the kernel: either close
+// (after an error reply, once zero-copy buffers are released) or resume
+// reading. Returns false if the connection was closed.
+bool Reactor::finish_output(uint64_t id, Connection& c) {
+    if (!c.out.empty()) return true;
+    if (c.closing) {
+        if (!c.busy && c.inflight == 0 && c.zc_pending.empty()) {
+            close_connection(id);
+            return false;
+        }
+        update_interest(id, c);
+        return true;
+    }
+    // The next request may already be buffered.
+    return process_input(id, c);
+}
+
+// Collect MSG_ZEROCOPY completion notifications from the socket error queue
+// and release the payloads they cover. Returns false on a real socket error.
+bool Reactor::read_completions(Connection& c) {
+#if HAVE_ZEROCOPY
+    while (true) {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c.fd, &msg, MSG_ERRQUEUE) < 0) break; // queue empty
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The kernel fell back to copying (always so on loopback)
+                zerocopy_copied.fetch_add(1);
+            }
+            // Completions cover send calls [ee_info, ee_data]; TCP reports
+            // them in order, so everything up to ee_data is done.
+            uint32_t hi = serr.ee_data;
+            while (!c.zc_pending.empty()
+                    && (int32_t)(hi - c.zc_pending.front().seq) >= 0) {
+                c.zc_pending.pop_front();
+            }
+        }
+    }
+#endif
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    return err == 0;
+}
+
+void Reactor::queue_reply(Connection& c, char op, bool tagged, uint32_t request_id,
+                          std::vector<unsigned char>&& payload) {
+    c.out.emplace_back();
+    OutFrame& f = c.out.back();
+    if (tagged) {
+        f.header.resize(TAGGED_HEADER_SIZE);
+        make_tagged_frame_header(f.header.data(), op, request_id, (uint32_t)payload.size());
+    } else {
+        f.header.resize(FRAME_HEADER_SIZE);
+        make_frame_header(f.header.data(), op, (uint32_t)payload.size());
+    }
+    f.payload.swap(payload);
+    f.sent = 0;
+    f.zerocopy = zerocopy_min_ > 0 && f.payload.size() >= zerocopy_min_;
+}
+
+void Reactor::update_interest(uint64_t id, Connection& c) {
+    uint32_t want = 0;
+    if (accepting(c)) want |= EPOLLIN | EPOLLRDHUP;
+    if (!c.out.empty()) want |= EPOLLOUT;
+    if (want == c.events) return;
+    epoll_event ev = {};
+    ev.events = want;
+    ev.data.u64 = id;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+    c.events = want;
+}
+
+void Reactor::close_connection(uint64_t id) {
+    auto it = conns_.find(id);
+    if (it == conns_.end()) return;
+    // Closing the fd also removes it from the epoll set.
+    close(it->second.fd);
+    conns_.erase(it);
+    active_clients.fetch_sub(1);
+    completed_clients.fetch_add(1);
+}
@@ -0,0 +1,152 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "protocol.h"
+
+// A read-only range of bytes owned by something else.
+struct ByteSpan {
+    const unsigned char *ptr;
+    size_t len;
+
+    ByteSpan() : ptr(nullptr), len(0) {}
+    ByteSpan(const char *p, size_t n) : ptr((const unsigned char *)p), len(n) {}
+    const unsigned char *data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+};
+
+// One complete request read off a connection, ready for a worker. The
+// parts point into the received message, which the request keeps in its
+// pooled receive buffer: payloads are never copied out.
+struct Request {
+    uint64_t conn_id;
+    char opcode;            // without OP_FLAG_TAGGED
+    bool tagged;            // pipelined request carrying request_id
+    uint32_t request_id;
+    PooledBuffer frame;     // the whole message
+    ByteSpan params;        // parameter block, if any
+    ByteSpan img1, img2;
+};
+
+// Reply to a Request, filled in by a worker.
+struct Response {
+    char opcode;
+    bool tagged;        // echo request_id (copied from the Request)
+    uint32_t request_id;
+    std::vector<unsigned char> payload;
+    bool close_after;   // close the connection once the reply is sent
+
+    Response() : opcode(0), tagged(false), request_id(0), close_after(false) {}
+};
+
+// Single-threaded epoll event loop that owns the listening socket and every
+// client socket. Sockets are non-blocking; request frames are assembled
+// incrementally in a per-connection buffer and only complete requests are
+// handed to the request handler (normally the first pipeline stage). Workers hand replies
+// back with post_response(), which wakes the loop through an eventfd.
+//
+// As with the old thread-per-client server, a connection has at most one
+// untagged request outstanding: reading from it resumes once its reply is
+// sent. Tagged requests (OP_FLAG_TAGGED) are pipelined: the connection keeps
+// being read until MAX_INFLIGHT of them are outstanding or awaiting send,
+// and their replies go out in completion order.
+class Reactor {
+public:
+    typedef std::function<void(Request&&)> RequestHandler;
+
+    Reactor(int listen_fd, int connectionlimit, uint32_t maxsize, uint32_t maxbatch);
+    ~Reactor();
+
+    // Create the epoll instance and wakeup eventfd. Returns false on failure.
+    bool init();
+
+    // Send reply payloads of at least min_bytes with MSG_ZEROCOPY (0 = never).
+    // Call before run(). Returns false if the kernel headers lack support.
+    bool set_zerocopy(size_t min_bytes);
+
+    // Run the event loop forever, passing each complete request to on_request.
+    void run(const RequestHandler& on_request);
+
+    // Queue a reply for the given connection. Safe to call from any thread;
+    // replies for connections that have since closed are dropped.
+    void post_response(uint64_t conn_id, Response&& resp);
+
+    // Read no further requests from a connection, and close it once the
+    // replies it is owed are sent. Only for the reactor thread (i.e. the
+    // request handler), so requests already buffered are not dispatched.
+    void stop_reading(uint64_t conn_id);
+
+private:
+    // A reply waiting to be written. The header and payload go out together
+    // in one sendmsg(); the payload is never copied into another buffer.
+    struct OutFrame {
+        std::vector<char> header; // heap-held so zero-copy sends can't
+                                  // see it move
+        std::vector<unsigned char> payload;
+        size_t sent;              // bytes of header + payload written so far
+        bool zerocopy;            // send with MSG_ZEROCOPY
+    };
+
+    // A zero-copy payload the kernel may still be reading from. It is kept
+    // alive until the completion for send call number `seq` is reported.
+    struct ZeroCopyPending {
+        uint32_t seq;
+        std::vector<char> header;
+        std::vector<unsigned char> payload;
+    };
+
+    struct Connection {
+        int fd;
+        uint32_t events;          // epoll interest currently registered
+        FrameReader in;           // received bytes not yet parsed
+        std::deque<OutFrame> out; // replies not yet fully sent
+        std::deque<ZeroCopyPending> zc_pending;
+        uint32_t zc_next;         // sequence number of the next zero-copy send
+        unsigned inflight;        // tagged requests with the workers
+        bool busy;                // an untagged request is with the workers
+        bool closing;             // close once all replies are flushed
+
+        Connection(int fd_, uint32_t maxsize, uint32_t maxbatch)
+            : fd(fd_), events(0), in(maxsize, maxbatch, true), zc_next(0), inflight(0),
+              busy(false), closing(false) {}
+    };
+
+    void accept_clients();
+    void reject_busy(int fd);
+    void drain_responses();
+    void handle_event(uint64_t id, uint32_t events);
+    bool read_input(uint64_t id, Connection& c);
+    bool process_input(uint64_t id, Connection& c);
+    bool flush_output(uint64_t id, Connection& c);
+    bool finish_output(uint64_t id, Connection& c);
+    bool read_completions(Connection& c);
+    bool accepting(const Connection& c) const;
+    void queue_reply(Connection& c, char op, bool tagged, uint32_t request_id,
+                     std::vector<unsigned char>&& payload);
+    void update_interest(uint64_t id, Connection& c);
+    void close_connection(uint64_t id);
+
+    int listen_fd_;
+    int connectionlimit_;
+    uint32_t maxsize_;
+    uint32_t maxbatch_;
+    size_t zerocopy_min_;
+    int epoll_fd_;
+    int wake_fd_;
+    uint64_t next_id_;
+    const RequestHandler *on_request_;
+    std::unordered_map<uint64_t, Connection> conns_;
+
+    std::mutex done_mutex_;
+    std::vector<std::pair<uint64_t, Response>> done_;
+};
+
+#endif // REACTOR_H
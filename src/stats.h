@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Server-wide counters printed on SIGHUP (defined in uqfacedetect.cpp).
+extern std::atomic<int> active_clients, completed_clients;
+extern std::atomic<int> detect_requests, replace_requests, invalid_requests;
+extern std::atomic<int> busy_connections;
+extern std::atomic<uint64_t> zerocopy_sends, zerocopy_copied;
+extern std::atomic<uint64_t> cache_hits, cache_misses, cache_evictions;
+
+// Current back-off suggested to clients in OP_SERVER_BUSY replies.
+extern std::atomic<uint32_t> retry_after_hint_ms;
+
+#endif // STATS_H
@@ -0,0 +1,104 @@
+// uqcompositebench.cpp
+// Microbenchmark for alpha compositing: times composite() against the
+// per-pixel Vec4b/Vec3b loop the replace path used before it, blending an
+// overlay onto the centre of a photo.
+//
+// Usage: ./uqcompositebench [--reps n] [--size px] [base overlay]
+// Defaults are face.jpg and overlay.png (run from src/), with the overlay
+// scaled to a square half the photo's smaller side unless --size is given.
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+#include "composite.h"
+#include "overlay.h"
+#include <opencv2/core/hal/intrin.hpp>
+
+// The replace path's loop before composite(): copy the overlay's colour
+// wherever its alpha is non-zero (no blending).
+static void old_loop(cv::Mat& image1, const cv::Rect& face, const cv::Mat& resized) {
+    for (int y = 0; y < face.height; ++y) {
+        for (int x = 0; x < face.width; ++x) {
+            cv::Vec4b pix = resized.at<cv::Vec4b>(y, x);
+            if (pix[3] > 0) {
+                image1.at<cv::Vec3b>(face.y + y, face.x + x) = cv::Vec3b(pix[0], pix[1], pix[2]);
+            }
+        }
+    }
+}
+
+// Average milliseconds per call of fn over reps calls, after one warm-up.
+static double time_ms(int reps, const std::function<void()>& fn) {
+    fn();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reps; ++i) fn();
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count() / reps;
+}
+
+int main(int argc, char *argv[]) {
+    int reps = 200, side = 0;
+    const char *names[2] = { "face.jpg", "overlay.png" };
+    int nnames = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            side = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && nnames < 2) {
+            names[nnames++] = argv[i];
+        } else {
+            std::cerr << "Usage: ./uqcompositebench [--reps n] [--size px] [base overlay]\n";
+            return 1;
+        }
+    }
+    cv::Mat base = cv::imread(names[0], cv::IMREAD_COLOR);
+    cv::Mat overlay = cv::imread(names[1], cv::IMREAD_UNCHANGED);
+    if (base.empty() || overlay.empty() || overlay.depth() != CV_8U) {
+        std::cerr << "uqcompositebench: unable to read \"" << names[0] << "\" and \""
+                  << names[1] << "\" as 8-bit images\n";
+        return 1;
+    }
+    // The old loop only handles a BGRA overlay on a BGR photo
+    if (overlay.channels() == 3) cv::cvtColor(overlay, overlay, cv::COLOR_BGR2BGRA);
+    if (overlay.channels() == 1) cv::cvtColor(overlay, overlay, cv::COLOR_GRAY2BGRA);
+    if (side == 0) side = std::min(base.cols, base.rows) / 2;
+    side = std::min(side, std::min(base.cols, base.rows));
+    cv::Rect face((base.cols - side) / 2, (base.rows - side) / 2, side, side);
+    cv::Mat resized, premul;
+    cv::resize(overlay, resized, face.size());
+    premultiply_overlay(resized, premul);
+
+    cv::Mat image = base.clone();
+    double t_old = time_ms(reps, [&] { old_loop(image, face, resized); });
+    double t_straight = time_ms(reps, [&] { composite(image, face, resized, ALPHA_STRAIGHT); });
+    double t_premul = time_ms(reps, [&] { composite(image, face, premul, ALPHA_PREMULTIPLIED); });
+    cv::Mat gray;
+    cv::cvtColor(base, gray, cv::COLOR_BGR2GRAY);
+    double t_gray = time_ms(reps, [&] { composite(gray, face, premul, ALPHA_PREMULTIPLIED); });
+
+    double mpix = (double)side * side / 1e6;
+    std::cout << names[0] << " " << base.cols << "x" << base.rows << ", " << names[1]
+              << " scaled to " << side << "x" << side << ", " << reps << " reps"
+#if CV_SIMD128
+              << ", SIMD kernels"
+#else
+              << ", scalar kernels"
+#endif
+              << "\n" << std::fixed << std::setprecision(3);
+    struct { const char *name; double ms; } rows[] = {
+        { "old Vec4b/Vec3b loop", t_old },
+        { "composite straight", t_straight },
+        { "composite premultiplied", t_premul },
+        { "composite premul, gray", t_gray },
+    };
+    for (auto& r : rows) {
+        std::cout << std::left << std::setw(26) << r.name << std::right << std::setw(10)
+                  << r.ms << " ms" << std::setw(10) << std::setprecision(1) << mpix * 1000 / r.ms
+                  << " Mpx/s" << std::setw(8) << t_old / r.ms << "x\n" << std::setprecision(3);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+// uqcompositetest.cpp
+// Checks every composite() row kernel (1, 3 and 4 channel bases; 3 and 4
+// channel overlays; straight and premultiplied alpha) against a floating
+// point "over" reference on random data. Row widths cover the SIMD main
+// loop, its scalar tail and rows too short for the vector path.
+// Exits with 0 if every pixel matches, 1 otherwise.
+
+#include <iostream>
+#include <cmath>
+#include <random>
+#include "composite.h"
+
+// Largest difference allowed from the reference: the kernels round
+// exactly, except that a gray base also rounds the overlay's luma first.
+static double tolerance(int bcn) {
+    return bcn == 1 ? 1.0 : 0.5;
+}
+
+// Fill a matrix with random bytes. Premultiplied overlays get colour values
+// no larger than their alpha, as premultiply_overlay() produces; a quarter
+// of the overlay pixels are fully transparent and a quarter fully opaque so
+// the a == 0 skip and the a == 255 case are both exercised.
+static void randomize(cv::Mat& m, bool overlay, bool premul, std::mt19937& rng) {
+    int cn = m.channels();
+    for (int y = 0; y < m.rows; ++y) {
+        uchar *p = m.ptr<uchar>(y);
+        for (int x = 0; x < m.cols; ++x, p += cn) {
+            for (int c = 0; c < cn; ++c) p[c] = (uchar)rng();
+            if (!overlay || cn != 4) continue;
+            unsigned kind = rng() % 4;
+            if (kind == 0) p[3] = 0;
+            if (kind == 1) p[3] = 255;
+            if (premul) {
+                for (int c = 0; c < 3; ++c) p[c] = (uchar)(p[3] ? p[c] % (p[3] + 1) : 0);
+            }
+        }
+    }
+}
+
+// Reference value of one base channel after blending, in floating point.
+static double reference(const uchar *d, const uchar *s, int bcn, int ocn, bool premul, int c) {
+    double a = ocn == 4 ? s[3] / 255.0 : 1.0;
+    // Resulting alpha is a + da * (1 - a)
+    if (bcn == 4 && c == 3) return 255.0 * a + d[3] * (1 - a);
+    if (a == 0) return d[c];
+    double o = bcn == 1 ? (29 * s[0] + 150 * s[1] + 77 * s[2]) / 256.0 : s[c];
+    return premul ? o + d[c] * (1 - a) : o * a + d[c] * (1 - a);
+}
+
+// Blend one random overlay onto a random base and compare every channel
+// of the target region with the reference, and everything outside it
+// with the original. Returns the number of mismatches (reported).
+static int check(int bcn, int ocn, bool premul, int width, std::mt19937& rng) {
+    const int rows = 3;
+    cv::Mat base(rows + 2, width + 5, CV_8UC(bcn));
+    cv::Mat overlay(rows, width, CV_8UC(ocn));
+    randomize(base, false, false, rng);
+    randomize(overlay, true, premul, rng);
+    cv::Mat before = base.clone();
+    cv::Rect where(3, 1, width, rows);
+    if (!composite(base, where, overlay, premul ? ALPHA_PREMULTIPLIED : ALPHA_STRAIGHT)) {
+        std::cout << "FAIL base " << bcn << " overlay " << ocn << ": layout rejected\n";
+        return 1;
+    }
+    int bad = 0;
+    for (int y = 0; y < base.rows; ++y) {
+        for (int x = 0; x < base.cols; ++x) {
+            const uchar *d0 = before.ptr<uchar>(y) + x * bcn;
+            const uchar *d = base.ptr<uchar>(y) + x * bcn;
+            bool inside = x >= where.x && x < where.x + width && y >= where.y && y < where.y + rows;
+            for (int c = 0; c < bcn; ++c) {
+                double want = d0[c];
+                double tol = 0;
+                if (inside) {
+                    const uchar *s = overlay.ptr<uchar>(y - where.y) + (x - where.x) * ocn;
+                    want = reference(d0, s, bcn, ocn, premul, c);
+                    tol = tolerance(bcn);
+                }
+                if (std::fabs(d[c] - want) > tol + 1e-9) {
+                    if (bad++ < 5) {
+                        std::cout << "FAIL base " << bcn << " overlay " << ocn
+                                  << (premul ? " premultiplied" : " straight") << " width "
+                                  << width << " at (" << x << "," << y << ") channel " << c
+                                  << ": got " << (int)d[c] << ", want " << want << "\n";
+                    }
+                }
+            }
+        }
+    }
+    return bad;
+}
+
+int main() {
+    std::mt19937 rng(2310);
+    const int widths[] = { 1, 7, 15, 16, 17, 31, 33, 64, 100 };
+    int failures = 0, kernels = 0;
+    for (int bcn : { 1, 3, 4 }) {
+        for (int ocn : { 3, 4 }) {
+            for (bool premul : { false, true }) {
+                int bad = 0;
+                for (int width : widths) {
+                    for (int rep = 0; rep < 20; ++rep) bad += check(bcn, ocn, premul, width, rng);
+                }
+                std::cout << (bad ? "FAIL" : "ok  ") << " base " << bcn << "ch, overlay "
+                          << ocn << "ch, " << (premul ? "premultiplied" : "straight") << "\n";
+                failures += bad != 0;
+                ++kernels;
+            }
+        }
+    }
+    // Unsupported layouts are refused rather than blended
+    cv::Mat two(4, 4, CV_8UC(2)), bgr(4, 4, CV_8UC3);
+    if (composite(two, cv::Rect(0, 0, 4, 4), bgr, ALPHA_STRAIGHT)
+            || composite(bgr, cv::Rect(0, 0, 4, 4), two, ALPHA_STRAIGHT)
+            || composite(bgr, cv::Rect(2, 2, 4, 4), bgr.clone(), ALPHA_STRAIGHT)) {
+        std::cout << "FAIL unsupported layout or region accepted\n";
+        ++failures;
+    }
+    std::cout << kernels << " kernel variants, " << failures << " failed\n";
+    return failures ? 1 : 0;
+}
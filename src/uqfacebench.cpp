@@ -0,0 +1,712 @@
+// uqfacebench.cpp
+// Load benchmark for uqfacedetect driven by the sample images. It starts
+// the server itself, so that it can also read the server's statistics
+// (SIGHUP) and memory use, then sends requests over loopback, one
+// connection per request as uqfaceclient does, and reports throughput and
+// latency. Pointing --server at a build of an older revision gives the
+// "before" numbers for a change.
+//
+// Usage: ./uqfacebench test [--server path] [--args "server arguments"]
+//                           [--image file] [--requests n] [--clients n ...]
+//                           [--sizes px ...] [--grid n] [--threads n ...]
+// Tests:
+//   throughput  detect requests from 1, 2, 4, 8 and 16 concurrent clients
+//   detectsize  detection latency at several detection size caps, for
+//               face1.jpg and a 20 MP enlargement of it
+//   faces       latency on a group photo (a grid of face1.jpg), with and
+//               without the eye search
+//   tail        latency percentiles of detect requests on the group photo
+//               sent one at a time to an otherwise idle server
+//   backends    latency and faces found by each detector backend on the
+//               sample images (YuNet needs --yunetmodel in --args)
+//   memory      sustained detect and replace load; the server's buffer
+//               pool statistics and resident memory afterwards
+//   tiles       detection latency and peak server memory on one very large
+//               image (compare with --tilepixels 0 in --args)
+//   workers     latency of the group photo with eyes searched (per-face eye
+//               search) and of a 36 MP image (tiled detection) on servers
+//               with 1, 2, 4 and 8 detect threads, one request at a time
+// Run from src/ so the sample images are found. The default server
+// arguments turn the reply and detection caches off, since the benchmark
+// sends the same images over and over.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+#include "protocol.h"
+
+static const char *USAGE =
+    "Usage: ./uqfacebench test [--server path] [--args \"server arguments\"]\n"
+    "                          [--image file] [--requests n] [--clients n ...]\n"
+    "                          [--sizes px ...] [--grid n] [--threads n ...]\n"
+    "Tests: throughput detectsize faces tail backends memory tiles workers\n";
+
+struct Options {
+    std::string test;
+    std::string server = "./uqfacedetect";
+    std::string args = "0 0 --cachesize 0 --detcachesize 0";
+    std::string image;                  // instead of the test's own images
+    int requests = 0;                   // per client (0 = the test's default)
+    int grid = 4;                       // group photo is grid x grid faces
+    std::vector<int> clients;
+    std::vector<int> sizes;             // detection size caps (tiles: image width)
+    std::vector<int> threads;           // detect threads (workers)
+};
+
+// Read a whole file. Returns false if it cannot be opened.
+static bool read_file(const std::string& name, std::vector<char>& data) {
+    std::ifstream in(name, std::ios::binary);
+    if (!in) return false;
+    data.assign(std::istreambuf_iterator<char>(in), {});
+    return true;
+}
+
+// Enlarge an image file to `width` pixels across and encode it as JPEG,
+// standing in for a phone photo. Returns false if it cannot be read.
+static bool enlarged_image(const std::string& name, int width, std::vector<char>& data) {
+    cv::Mat image = cv::imread(name, cv::IMREAD_COLOR);
+    if (image.empty()) return false;
+    cv::Mat big;
+    cv::resize(image, big, cv::Size(width, (int)((double)image.rows * width / image.cols)),
+               0, 0, cv::INTER_LINEAR);
+    std::vector<uchar> buf;
+    if (!cv::imencode(".jpg", big, buf)) return false;
+    data.assign(buf.begin(), buf.end());
+    return true;
+}
+
+// Tile `grid` x `grid` copies of an image file into one JPEG, standing in
+// for a group photo. Returns false if it cannot be read.
+static bool group_image(const std::string& name, int grid, std::vector<char>& data) {
+    cv::Mat image = cv::imread(name, cv::IMREAD_COLOR);
+    if (image.empty()) return false;
+    cv::Mat group(image.rows * grid, image.cols * grid, image.type());
+    for (int y = 0; y < grid; ++y) {
+        for (int x = 0; x < grid; ++x) {
+            cv::Mat cell = group(cv::Rect(x * image.cols, y * image.rows, image.cols, image.rows));
+            image.copyTo(cell);
+        }
+    }
+    std::vector<uchar> buf;
+    if (!cv::imencode(".jpg", group, buf)) return false;
+    data.assign(buf.begin(), buf.end());
+    return true;
+}
+
+// The image a multi-face test runs on: --image, or a group photo.
+static bool multi_face_image(const Options& opt, std::string& name, std::vector<char>& data) {
+    if (!opt.image.empty()) {
+        name = opt.image;
+        return read_file(opt.image, data);
+    }
+    name = std::to_string(opt.grid) + "x" + std::to_string(opt.grid) + " grid of face1.jpg";
+    return group_image("face1.jpg", opt.grid, data);
+}
+
+// A uqfacedetect process started for the benchmark. Its stderr is read on
+// a separate thread so the server never blocks writing statistics.
+class Server {
+public:
+    Server() : pid_(-1), port_(0) {}
+    ~Server() { stop(); }
+
+    // Start `path` with the whitespace-separated `args` and wait for it to
+    // print its port. Returns false if it does not start.
+    bool start(const std::string& path, const std::string& args) {
+        std::vector<std::string> words;
+        std::istringstream in(args);
+        for (std::string w; in >> w; ) words.push_back(w);
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(path.c_str()));
+        for (auto& w : words) argv.push_back(const_cast<char *>(w.c_str()));
+        argv.push_back(nullptr);
+        int fds[2];
+        if (pipe(fds) < 0) return false;
+        pid_ = fork();
+        if (pid_ == 0) {
+            dup2(fds[1], 2);
+            close(fds[0]);
+            close(fds[1]);
+            execv(path.c_str(), argv.data());
+            _exit(127);
+        }
+        close(fds[1]);
+        if (pid_ < 0) {
+            close(fds[0]);
+            return false;
+        }
+        reader_ = std::thread(&Server::read_stderr, this, fds[0]);
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait_for(lock, std::chrono::seconds(10), [this] { return !lines_.empty() || eof_; });
+        if (lines_.empty() || (port_ = atoi(lines_[0].c_str())) <= 0) {
+            std::cerr << "uqfacebench: " << path << " did not start"
+                      << (lines_.empty() ? "" : ": " + lines_[0]) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Stop the server and collect it.
+    void stop() {
+        if (pid_ > 0) {
+            kill(pid_, SIGKILL);
+            waitpid(pid_, nullptr, 0);
+            pid_ = -1;
+        }
+        if (reader_.joinable()) reader_.join();
+    }
+
+    int port() const { return port_; }
+
+    // A "VmRSS:"-style field of /proc/<pid>/status, in KiB (0 if absent).
+    long memory_kb(const std::string& field) const {
+        std::ifstream in("/proc/" + std::to_string(pid_) + "/status");
+        for (std::string line; std::getline(in, line); ) {
+            if (line.compare(0, field.size(), field) == 0) return atol(line.c_str() + field.size());
+        }
+        return 0;
+    }
+
+    // Ask for statistics (SIGHUP) and return the lines printed in reply,
+    // once the server has gone quiet for a second (it writes them one at a
+    // time, and a busy server can pause between them).
+    std::vector<std::string> stats() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t first = lines_.size();
+        kill(pid_, SIGHUP);
+        size_t seen;
+        do {
+            seen = lines_.size();
+            cond_.wait_for(lock, std::chrono::milliseconds(1000));
+        } while (lines_.size() != seen || seen == first);
+        return std::vector<std::string>(lines_.begin() + first, lines_.end());
+    }
+
+    // The first statistics line starting with `prefix`, or "". Asks again
+    // if a reply was cut short before that line.
+    std::string stat(const std::string& prefix) {
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            for (auto& line : stats()) {
+                if (line.compare(0, prefix.size(), prefix) == 0) return line;
+            }
+        }
+        return "";
+    }
+
+private:
+    void read_stderr(int fd) {
+        std::string partial;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            partial.append(buf, n);
+            size_t nl;
+            while ((nl = partial.find('\n')) != std::string::npos) {
+                lines_.push_back(partial.substr(0, nl));
+                partial.erase(0, nl + 1);
+            }
+            cond_.notify_all();
+        }
+        close(fd);
+        std::lock_guard<std::mutex> lock(mutex_);
+        eof_ = true;
+        cond_.notify_all();
+    }
+
+    pid_t pid_;
+    int port_;
+    std::thread reader_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::string> lines_;
+    bool eof_ = false;
+};
+
+// One request: opcode, optional parameter block and one or two images.
+struct Request {
+    char op;
+    std::vector<char> params;
+    const std::vector<char> *img1;
+    const std::vector<char> *img2;
+};
+
+// What came back for one request.
+struct Reply {
+    char op;
+    std::vector<char> payload;
+};
+
+// Connect to the server on the loopback interface.
+static int connect_to(int port) {
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", std::to_string(port).c_str(), &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Send one request on a new connection and wait for the reply. Returns
+// false on a connection error.
+static bool send_request(int port, const Request& req, Reply& reply) {
+    int fd = connect_to(port);
+    if (fd < 0) return false;
+    std::vector<char> header(FRAME_HEADER_SIZE);
+    uint32_t size1 = req.img1->size();
+    char op = req.op;
+    if (!req.params.empty()) op |= OP_FLAG_PARAMS;
+    make_frame_header(header.data(), op, req.params.empty() ? size1 : req.params.size());
+    if (!req.params.empty()) {
+        header.insert(header.end(), req.params.begin(), req.params.end());
+        header.resize(header.size() + 4);
+        put_le32(header.data() + header.size() - 4, size1);
+    }
+    char lenbuf2[4];
+    iovec iov[4];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = header.data();
+    iov[iovcnt++].iov_len = header.size();
+    iov[iovcnt].iov_base = const_cast<char *>(req.img1->data());
+    iov[iovcnt++].iov_len = size1;
+    if (req.img2) {
+        put_le32(lenbuf2, req.img2->size());
+        iov[iovcnt].iov_base = lenbuf2;
+        iov[iovcnt++].iov_len = 4;
+        iov[iovcnt].iov_base = const_cast<char *>(req.img2->data());
+        iov[iovcnt++].iov_len = req.img2->size();
+    }
+    FrameReader reader(0, 0, false);
+    FrameInfo info;
+    FrameStatus status;
+    bool ok = send_iov(fd, iov, iovcnt) && reader.read_frame(fd, info, status)
+        && status == FRAME_COMPLETE;
+    if (ok) {
+        reply.op = info.op;
+        const char *p = reader.data() + info.offset[0];
+        reply.payload.assign(p, p + info.size[0]);
+    }
+    close(fd);
+    return ok;
+}
+
+// Latencies (ms) and outcome counts of a run.
+struct Load {
+    std::vector<double> ms;     // successful requests
+    int rejected = 0;           // busy or error replies
+    int failed = 0;             // connection errors
+    double seconds = 0;         // wall time of the whole run
+};
+
+// `clients` threads each send `per_client` requests, one at a time, taking
+// turns through reqs.
+static Load run_load(int port, const std::vector<Request>& reqs, int clients, int per_client) {
+    Load load;
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&] {
+            Reply reply;
+            for (int i = 0; i < per_client; ++i) {
+                auto t0 = std::chrono::steady_clock::now();
+                bool ok = send_request(port, reqs[i % reqs.size()], reply);
+                double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t0).count();
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!ok) {
+                    ++load.failed;
+                } else if (reply.op == OP_OUTPUT_IMAGE || reply.op == OP_DETECTIONS) {
+                    load.ms.push_back(ms);
+                } else {
+                    ++load.rejected;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    load.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return load;
+}
+
+static Load run_load(int port, const Request& req, int clients, int per_client) {
+    return run_load(port, std::vector<Request>(1, req), clients, per_client);
+}
+
+// The p-th percentile (0-100) of the latencies, or 0 if there are none.
+static double percentile(std::vector<double> ms, double p) {
+    if (ms.empty()) return 0;
+    std::sort(ms.begin(), ms.end());
+    size_t i = (size_t)(p / 100 * (ms.size() - 1) + 0.5);
+    return ms[std::min(i, ms.size() - 1)];
+}
+
+static double average(const std::vector<double>& ms) {
+    double sum = 0;
+    for (double v : ms) sum += v;
+    return ms.empty() ? 0 : sum / ms.size();
+}
+
+ // Requests per client: --requests, or the test's default.
+static int requests(const Options& opt, int fallback) {
+    return opt.requests ? opt.requests : fallback;
+}
+
+// Faces listed in an OP_DETECTIONS reply, or -1 for any other reply.
+static int face_count(const Reply& reply) {
+    if (reply.op != OP_DETECTIONS || reply.payload.size() < 4) return -1;
+    return (int)get_le32(reply.payload.data());
+}
+
+// Throughput of detect requests at increasing numbers of clients.
+static int test_throughput(const Options& opt, Server& server) {
+    std::string name = opt.image.empty() ? "face.jpg" : opt.image;
+    std::vector<char> image;
+    if (!read_file(name, image)) {
+        std::cerr << "uqfacebench: unable to open \"" << name << "\"\n";
+        return 1;
+    }
+    std::vector<int> clients = opt.clients;
+    if (clients.empty()) clients = { 1, 2, 4, 8, 16 };
+    Request req = { OP_FACE_DETECT, {}, &image, nullptr };
+    int n = requests(opt, 20);
+    std::cout << "detect " << name << ", " << n << " requests per client\n"
+              << std::setw(8) << "clients" << std::setw(10) << "req/s" << std::setw(10)
+              << "avg ms" << std::setw(10) << "p95 ms" << std::setw(10) << "rejected"
+              << std::setw(8) << "failed" << "\n" << std::fixed << std::setprecision(1);
+    for (int c : clients) {
+        Load load = run_load(server.port(), req, c, n);
+        std::cout << std::setw(8) << c << std::setw(10) << load.ms.size() / load.seconds
+                  << std::setw(10) << average(load.ms) << std::setw(10)
+                  << percentile(load.ms, 95) << std::setw(10) << load.rejected
+                  << std::setw(8) << load.failed << "\n";
+    }
+    return 0;
+}
+
+// Latency of rectangles-only requests (decode and detect, no drawing or
+// encoding) at each detection size cap, given per request, from one client.
+static int test_detectsize(const Options& opt, Server& server) {
+    std::vector<std::string> names;
+    std::vector<std::vector<char>> images(2);
+    if (!opt.image.empty()) {
+        names.push_back(opt.image);
+        images.resize(1);
+    } else {
+        names = { "face1.jpg", "face1.jpg enlarged to 6000 px" };
+    }
+    if (!read_file(opt.image.empty() ? "face1.jpg" : opt.image, images[0])
+            || (images.size() > 1 && !enlarged_image("face1.jpg", 6000, images[1]))) {
+        std::cerr << "uqfacebench: unable to read the test images\n";
+        return 1;
+    }
+    std::vector<int> sizes = opt.sizes;
+    if (sizes.empty()) sizes = { 0, 2048, 1280, 640, 320 };
+    int n = requests(opt, 10);
+    std::cout << n << " rectangles-only requests per cap, one client\n"
+              << std::left << std::setw(32) << "image" << std::right << std::setw(8) << "cap"
+              << std::setw(10) << "avg ms" << std::setw(10) << "p50 ms" << std::setw(10)
+              << "max ms" << std::setw(7) << "faces" << "\n" << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < images.size(); ++i) {
+        for (int size : sizes) {
+            Request req = { OP_FACE_RECTS, {}, &images[i], nullptr };
+            append_param(req.params, PARAM_DETECT_SIZE, size);
+            Load load = run_load(server.port(), req, 1, n);
+            Reply reply;
+            int faces = send_request(server.port(), req, reply) ? face_count(reply) : -1;
+            std::cout << std::left << std::setw(32) << names[i] << std::right << std::setw(8)
+                      << (size ? std::to_string(size) : "full") << std::setw(10)
+                      << average(load.ms) << std::setw(10) << percentile(load.ms, 50)
+                      << std::setw(10) << percentile(load.ms, 100) << std::setw(7) << faces << "\n";
+        }
+    }
+    return 0;
+}
+
+// Latency of detect requests on a multi-face image with the eye search
+// and without it (PARAM_SKIP_EYES), one request at a time.
+static int test_faces(const Options& opt, Server& server) {
+    std::string name;
+    std::vector<char> image;
+    if (!multi_face_image(opt, name, image)) {
+        std::cerr << "uqfacebench: unable to read the test image\n";
+        return 1;
+    }
+    Request rects = { OP_FACE_RECTS, {}, &image, nullptr };
+    Reply reply;
+    int faces = send_request(server.port(), rects, reply) ? face_count(reply) : -1;
+    int n = requests(opt, 20);
+    std::cout << "detect " << name << " (" << faces << " faces found), " << n
+              << " requests, one client\n" << std::left << std::setw(12) << "eyes"
+              << std::right << std::setw(10) << "avg ms" << std::setw(10) << "p50 ms"
+              << std::setw(10) << "max ms" << std::setw(10) << "rejected" << "\n"
+              << std::fixed << std::setprecision(1);
+    for (int skip = 0; skip <= 1; ++skip) {
+        Request req = { OP_FACE_DETECT, {}, &image, nullptr };
+        // Only sent when needed, so servers without parameters can be compared
+        if (skip) append_param(req.params, PARAM_SKIP_EYES, 1);
+        Load load = run_load(server.port(), req, 1, n);
+        std::cout << std::left << std::setw(12) << (skip ? "skipped" : "searched") << std::right
+                  << std::setw(10) << average(load.ms) << std::setw(10) << percentile(load.ms, 50)
+                  << std::setw(10) << percentile(load.ms, 100) << std::setw(10)
+                  << load.rejected + load.failed << "\n";
+    }
+    return 0;
+}
+
+// Latency distribution of detect requests on a multi-face image, one at a
+// time, so a request's own faces are all the server has to work on.
+static int test_tail(const Options& opt, Server& server) {
+    std::string name;
+    std::vector<char> image;
+    if (!multi_face_image(opt, name, image)) {
+        std::cerr << "uqfacebench: unable to read the test image\n";
+        return 1;
+    }
+    Request req = { OP_FACE_DETECT, {}, &image, nullptr };
+    Load load = run_load(server.port(), req, 1, requests(opt, 200));
+    std::cout << "detect " << name << ", " << load.ms.size() << " requests, one client\n"
+              << std::fixed << std::setprecision(1);
+    for (double p : { 50.0, 90.0, 95.0, 99.0, 100.0 }) {
+        std::cout << std::setw(6) << (p == 100 ? "max" : "p" + std::to_string((int)p))
+                  << std::setw(10) << percentile(load.ms, p) << " ms\n";
+    }
+    std::cout << std::setw(6) << "avg" << std::setw(10) << average(load.ms) << " ms\n";
+    if (load.rejected + load.failed) {
+        std::cout << load.rejected + load.failed << " requests rejected or failed\n";
+    }
+    return 0;
+}
+
+// Latency and faces found for rectangles-only requests through each
+// detector backend (PARAM_BACKEND), on each sample image.
+static int test_backends(const Options& opt, Server& server) {
+    std::vector<std::string> names = { "face.jpg", "face1.jpg", "overlay.png" };
+    if (!opt.image.empty()) names = { opt.image };
+    const char *backends[] = { "haar", "lbp", "yunet" };
+    int n = requests(opt, 10);
+    std::cout << n << " rectangles-only requests per image and backend, one client\n"
+              << std::left << std::setw(14) << "image" << std::setw(8) << "backend"
+              << std::right << std::setw(10) << "avg ms" << std::setw(10) << "p50 ms"
+              << std::setw(7) << "faces" << "\n" << std::fixed << std::setprecision(1);
+    for (auto& name : names) {
+        std::vector<char> image;
+        if (!read_file(name, image)) {
+            std::cerr << "uqfacebench: unable to open \"" << name << "\"\n";
+            return 1;
+        }
+        for (int b = 0; b < 3; ++b) {
+            Request req = { OP_FACE_RECTS, {}, &image, nullptr };
+            append_param(req.params, PARAM_BACKEND, b);
+            std::cout << std::left << std::setw(14) << name << std::setw(8) << backends[b]
+                      << std::right;
+            // A backend the server could not load answers with an error
+            Reply reply;
+            if (!send_request(server.port(), req, reply)) {
+                std::cout << "  connection failed\n";
+                continue;
+            }
+            if (reply.op != OP_DETECTIONS) {
+                std::cout << "  unavailable: "
+                          << std::string(reply.payload.begin(), reply.payload.end()) << "\n";
+                continue;
+            }
+            Load load = run_load(server.port(), req, 1, n);
+            std::cout << std::setw(10) << average(load.ms) << std::setw(10)
+                      << percentile(load.ms, 50) << std::setw(7) << face_count(reply) << "\n";
+        }
+    }
+    return 0;
+}
+
+// Memory behaviour under sustained load: clients alternate detect requests
+// for face.jpg and replace requests overlaying overlay.png on it. Compare
+// runs with and without --args "... --imagepool 268435456" (image pool on).
+static int test_memory(const Options& opt, Server& server) {
+    std::vector<char> image, overlay;
+    if (!read_file(opt.image.empty() ? "face.jpg" : opt.image, image)
+            || !read_file("overlay.png", overlay)) {
+        std::cerr << "uqfacebench: unable to read the test images\n";
+        return 1;
+    }
+    std::vector<Request> reqs = {
+        { OP_FACE_DETECT, {}, &image, nullptr },
+        { OP_FACE_REPLACE, {}, &image, &overlay },
+    };
+    int clients = opt.clients.empty() ? 4 : opt.clients[0];
+    int n = requests(opt, 50);
+    long idle_kb = server.memory_kb("VmRSS:");
+    Load load = run_load(server.port(), reqs, clients, n);
+    std::cout << clients << " clients x " << n << " requests (detect and replace), "
+              << std::fixed << std::setprecision(1) << load.ms.size() / load.seconds
+              << " req/s, avg " << average(load.ms) << " ms, "
+              << load.rejected + load.failed << " rejected or failed\n"
+              << "RSS before load: " << idle_kb / 1024.0 << " MiB, after: "
+              << server.memory_kb("VmRSS:") / 1024.0 << " MiB, peak: "
+              << server.memory_kb("VmHWM:") / 1024.0 << " MiB\n";
+    for (auto& line : server.stats()) {
+        if (line.compare(0, 7, "Receive") == 0 || line.compare(0, 5, "Image") == 0) {
+            std::cout << line << "\n";
+        }
+    }
+    return 0;
+}
+
+// Detection latency and peak server memory on one very large image (by
+// default face1.jpg enlarged to 8000 px wide, about 36 MP), one request at
+// a time. Run once as is and once with --tilepixels 0 in --args to compare
+// tiled with whole-image detection; each run starts a fresh server, so its
+// peak resident memory (VmHWM) covers only that run.
+static int test_tiles(const Options& opt, Server& server) {
+    int width = opt.sizes.empty() ? 8000 : opt.sizes[0];
+    std::vector<char> image;
+    if (!(opt.image.empty() ? enlarged_image("face1.jpg", width, image)
+                            : read_file(opt.image, image))) {
+        std::cerr << "uqfacebench: unable to read the test image\n";
+        return 1;
+    }
+    std::string name = opt.image.empty() ? "face1.jpg enlarged to " + std::to_string(width) + " px"
+                                         : opt.image;
+    Request req = { OP_FACE_RECTS, {}, &image, nullptr };
+    int n = requests(opt, 5);
+    long idle_kb = server.memory_kb("VmRSS:");
+    Load load = run_load(server.port(), req, 1, n);
+    Reply reply;
+    int faces = send_request(server.port(), req, reply) ? face_count(reply) : -1;
+    std::cout << name << ", " << n << " rectangles-only requests, one client\n"
+              << std::fixed << std::setprecision(1) << "avg " << average(load.ms) << " ms, p50 "
+              << percentile(load.ms, 50) << " ms, max " << percentile(load.ms, 100) << " ms, "
+              << faces << " faces, " << load.rejected + load.failed << " rejected or failed\n"
+              << "RSS before load: " << idle_kb / 1024.0 << " MiB, peak: "
+              << server.memory_kb("VmHWM:") / 1024.0 << " MiB\n";
+    for (auto& line : server.stats()) {
+        if (line.compare(0, 5, "Tiled") == 0) std::cout << line << "\n";
+    }
+    return 0;
+}
+
+// How request latency scales with the detect stage's workers, which
+// share a request's parallel work (eye searches, tiles) by stealing.
+// Starts its own server for each thread count, with --detectthreads
+// added to the server arguments.
+static int test_workers(const Options& opt) {
+    std::string group_name;
+    std::vector<char> group, large;
+    if (!multi_face_image(opt, group_name, group) || !enlarged_image("face1.jpg", 8000, large)) {
+        std::cerr << "uqfacebench: unable to read the test images\n";
+        return 1;
+    }
+    std::vector<int> threads = opt.threads;
+    if (threads.empty()) threads = { 1, 2, 4, 8 };
+    int n = requests(opt, 10);
+    std::cout << "server: " << opt.server << " " << opt.args << " --detectthreads n\n"
+              << n << " requests per test, one at a time, " << std::thread::hardware_concurrency()
+              << " cores\n" << std::left << std::setw(44) << "test" << std::right << std::setw(8)
+              << "threads" << std::setw(10) << "avg ms" << std::setw(10) << "p50 ms"
+              << std::setw(9) << "speedup" << std::setw(9) << "stolen" << "\n"
+              << std::fixed << std::setprecision(1);
+    struct Test {
+        std::string name;
+        Request req;
+        double base_ms;
+    } tests[] = {
+        { "detect " + group_name + ", eyes", { OP_FACE_DETECT, {}, &group, nullptr }, 0 },
+        { "rects of face1.jpg enlarged to 8000 px", { OP_FACE_RECTS, {}, &large, nullptr }, 0 },
+    };
+    for (auto& test : tests) {
+        for (int t : threads) {
+            Server server;
+            if (!server.start(opt.server, opt.args + " --detectthreads " + std::to_string(t))) {
+                return 2;
+            }
+            Reply reply;
+            send_request(server.port(), test.req, reply);     // warm-up
+            Load load = run_load(server.port(), test.req, 1, n);
+            double ms = average(load.ms);
+            if (test.base_ms == 0) test.base_ms = ms;
+            // Subtasks taken by another detect worker than the one that
+            // made them: the last field of the stage's statistics
+            std::string line = server.stat("Stage detect");
+            size_t comma = line.rfind(", ");
+            std::string stolen = comma == std::string::npos ? "?" : line.substr(comma + 2);
+            stolen = stolen.substr(0, stolen.find(' '));
+            std::cout << std::left << std::setw(44) << test.name << std::right << std::setw(8) << t
+                      << std::setw(10) << ms << std::setw(10) << percentile(load.ms, 50)
+                      << std::setw(8) << test.base_ms / ms << "x" << std::setw(9) << stolen << "\n";
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--server" && has_value) {
+            opt.server = argv[++i];
+        } else if (arg == "--args" && has_value) {
+            opt.args = argv[++i];
+        } else if (arg == "--image" && has_value) {
+            opt.image = argv[++i];
+        } else if (arg == "--requests" && has_value && atoi(argv[i + 1]) > 0) {
+            opt.requests = atoi(argv[++i]);
+        } else if (arg == "--clients" && has_value && atoi(argv[i + 1]) > 0) {
+            while (i + 1 < argc && atoi(argv[i + 1]) > 0) opt.clients.push_back(atoi(argv[++i]));
+        } else if (arg == "--threads" && has_value && atoi(argv[i + 1]) > 0) {
+            while (i + 1 < argc && atoi(argv[i + 1]) > 0) opt.threads.push_back(atoi(argv[++i]));
+        } else if (arg == "--grid" && has_value && atoi(argv[i + 1]) > 0) {
+            opt.grid = atoi(argv[++i]);
+        } else if (arg == "--sizes" && has_value && isdigit((unsigned char)argv[i + 1][0])) {
+            while (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) {
+                opt.sizes.push_back(atoi(argv[++i]));
+            }
+        } else if (arg[0] != '-' && opt.test.empty()) {
+            opt.test = arg;
+        } else {
+            std::cerr << USAGE;
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // Starts servers of its own
+    if (opt.test == "workers") return test_workers(opt);
+    int (*test)(const Options&, Server&) = nullptr;
+    if (opt.test == "throughput") test = test_throughput;
+    if (opt.test == "detectsize") test = test_detectsize;
+    if (opt.test == "faces") test = test_faces;
+    if (opt.test == "tail") test = test_tail;
+    if (opt.test == "backends") test = test_backends;
+    if (opt.test == "memory") test = test_memory;
+    if (opt.test == "tiles") test = test_tiles;
+    if (!test) {
+        std::cerr << USAGE;
+        return 1;
+    }
+    Server server;
+    if (!server.start(opt.server, opt.args)) return 2;
+    std::cout << "server: " << opt.server << " " << opt.args << "\n";
+    return test(opt, server);
+}
@@ -2,68 +2,349 @@
 // Face detection client: parses command-line, sends request, handles response.
 
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cerrno>
 #include <cstring>
+#include <thread>
 #include <netdb.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include "protocol.h"
 
+static const char *USAGE =
+    "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n"
+    "       [--rects] [--pipeline filename ...] [--overlay handle] [--register filename]\n"
+    "       [--detectsize px] [--scalefactor f] [--minneighbors n] [--minface px] [--maxface px]\n"
+    "       [--largest] [--noeyes] [--backend haar|lbp|yunet] [--format jpeg|png|webp]\n"
+    "       [--jpegquality n] [--jpegoptimize] [--jpegprogressive] [--pnglevel n] [--webpquality n]\n";
+
+// Format an OP_DETECTIONS payload as text, one "face" line per face followed
+// by an indented "eye" line per eye. Returns false if the payload is malformed.
+static bool print_detections(std::ostream& out, const char *p, uint32_t len) {
+    const char *end = p + len;
+    if (end - p < 4) return false;
+    uint32_t nfaces = get_le32(p);
+    p += 4;
+    for (uint32_t i = 0; i < nfaces; ++i) {
+        if (end - p < 20) return false;
+        out << "face " << get_le32(p) << " " << get_le32(p + 4) << " "
+            << get_le32(p + 8) << " " << get_le32(p + 12) << "\n";
+        uint32_t neyes = get_le32(p + 16);
+        p += 20;
+        for (uint32_t j = 0; j < neyes; ++j) {
+            if (end - p < 16) return false;
+            out << "  eye " << get_le32(p) << " " << get_le32(p + 4) << " "
+                << get_le32(p + 8) << " " << get_le32(p + 12) << "\n";
+            p += 16;
+        }
+    }
+    return p == end;
+}
+
+// Read a whole file. Returns false if it cannot be opened.
+static bool read_file(const std::string& name, std::vector<char>& data) {
+    std::ifstream in(name, std::ios::binary);
+    if (!in) return false;
+    data.assign(std::istreambuf_iterator<char>(in), {});
+    return true;
+}
+
+// Parse a non-negative option value and scale it to the protocol's integer
+// unit (e.g. thousandths). Values of `unit` 1 must be whole numbers.
+static bool parse_param_value(const char *s, double unit, uint32_t& out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (*s == '\0' || *end != '\0' || !(v >= 0) || v * unit > 0xFFFFFFFFu
+            || (unit == 1 && v != (uint32_t)v)) {
+        return false;
+    }
+    out = (uint32_t)(v * unit + 0.5);
+    return true;
+}
+
+// File name extension for an encoded image, from its signature.
+static const char *image_extension(const char *data, uint32_t size) {
+    if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) return ".png";
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0) return ".webp";
+    return ".jpg";
+}
+
+// Build the start of a request up to the first image, which follows
+// directly: the header (tagged if `tagged`), the parameter block if there
+// is one, and the image length.
+static std::vector<char> request_header(char op, bool tagged, uint32_t request_id,
+                                        const std::vector<char>& params, uint32_t size1) {
+    std::vector<char> header(tagged ? TAGGED_HEADER_SIZE : FRAME_HEADER_SIZE);
+    if (!params.empty()) op |= OP_FLAG_PARAMS;
+    uint32_t len = params.empty() ? size1 : params.size();
+    if (tagged) {
+        make_tagged_frame_header(header.data(), op, request_id, len);
+    } else {
+        make_frame_header(header.data(), op, len);
+    }
+    if (!params.empty()) {
+        header.insert(header.end(), params.begin(), params.end());
+        char lenbuf[4];
+        put_le32(lenbuf, size1);
+        header.insert(header.end(), lenbuf, lenbuf + 4);
+    }
+    return header;
+}
+
+// Send every file as a tagged request (the tag is its index) from a
+// separate thread, so that requests keep flowing while replies are read
+// back in whatever order the server completes them. Output images are
+// written to "<file>.out.jpg" (.png, .webp for those formats); rectangles
+// are printed under a "file" line.
+static int run_pipeline(int sockfd, char op, const std::vector<std::string>& files,
+                        const std::vector<std::vector<char>>& images,
+                        std::vector<char>& img2_data, const std::vector<char>& params) {
+    std::thread sender([&]() {
+        char lenbuf2[4];
+        put_le32(lenbuf2, img2_data.size());
+        for (size_t i = 0; i < images.size(); ++i) {
+            std::vector<char> header = request_header(op, true, i, params, images[i].size());
+            iovec iov[4];
+            int iovcnt = 0;
+            iov[iovcnt].iov_base = header.data();
+            iov[iovcnt++].iov_len = header.size();
+            iov[iovcnt].iov_base = (void *)images[i].data();
+            iov[iovcnt++].iov_len = images[i].size();
+            if (!img2_data.empty()) {
+                iov[iovcnt].iov_base = lenbuf2;
+                iov[iovcnt++].iov_len = 4;
+                iov[iovcnt].iov_base = img2_data.data();
+                iov[iovcnt++].iov_len = img2_data.size();
+            }
+            if (!send_iov(sockfd, iov, iovcnt)) break;
+        }
+        // No more requests; the server still answers those in flight
+        shutdown(sockfd, SHUT_WR);
+    });
+
+    int result = 0;
+    std::vector<bool> answered(files.size(), false);
+    size_t remaining = files.size();
+    FrameReader reader(0, 0, false);
+    while (remaining > 0) {
+        FrameInfo info;
+        FrameStatus status;
+        if (!reader.read_frame(sockfd, info, status) || status != FRAME_COMPLETE
+                || !info.tagged || info.request_id >= files.size()
+                || answered[info.request_id]) {
+            std::cerr << "uqfaceclient: a communication error occurred\n";
+            result = 10;
+            break;
+        }
+        answered[info.request_id] = true;
+        --remaining;
+        const std::string& file = files[info.request_id];
+        const char *data = reader.data() + info.offset[0];
+        uint32_t size = info.size[0];
+        if (info.op == OP_OUTPUT_IMAGE) {
+            std::string outname = file + ".out" + image_extension(data, size);
+            std::ofstream out(outname, std::ios::binary);
+            if (!out) {
+                std::cerr << "uqfaceclient: cannot open the output file \"" << outname << "\" for writing\n";
+                result = 9;
+            } else {
+                out.write(data, size);
+            }
+        } else if (info.op == OP_DETECTIONS) {
+            std::cout << "file " << file << "\n";
+            if (!print_detections(std::cout, data, size)) {
+                std::cerr << "uqfaceclient: a communication error occurred\n";
+                result = 10;
+                break;
+            }
+        } else if (info.op == OP_SERVER_BUSY && size >= 4) {
+            std::cerr << "uqfaceclient: " << file << ": server busy, retry after "
+                      << get_le32(data) << " ms\n";
+            if (result == 0) result = 19;
+        } else if (info.op == OP_ERROR_MESSAGE) {
+            std::cerr << "uqfaceclient: " << file << ": got the following error message: \""
+                      << std::string(data, size) << "\"\n";
+            result = 20;
+        } else {
+            std::cerr << "uqfaceclient: a communication error occurred\n";
+            result = 10;
+            break;
+        }
+        reader.consume(info.total);
+    }
+    // Unblock the sender if we gave up early
+    if (remaining > 0) shutdown(sockfd, SHUT_RDWR);
+    sender.join();
+    close(sockfd);
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n";
+        std::cerr << USAGE;
         return 18;
     }
     std::string port_str = argv[1];
     std::string infile1 = "";  // for --detect
     std::string infile2 = "";  // for --replacefilename
     std::string outfile = "";  // for --outputimage
+    bool rects = false;        // --rects: ask for rectangles, not an image
+    std::vector<std::string> pipeline;  // --pipeline: files sent as tagged requests
+    std::string handle_str = "";  // --overlay: registered overlay to replace with
+    std::string regfile = "";     // --register: overlay to register
+    std::vector<char> params;     // request parameter block
+    uint32_t jpeg_flags = 0;      // --jpegoptimize, --jpegprogressive
 
     // Parse options
     for (int i = 2; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--outputimage") {
             if (!outfile.empty() || i+1 >= argc) {
-                std::cerr << "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n";
+                std::cerr << USAGE;
                 return 18;
             }
             outfile = argv[++i];
-            if (outfile.empty()) { std::cerr << "Usage: ./uqfaceclient portnum ...\n"; return 18; }
+            if (outfile.empty()) { std::cerr << USAGE; return 18; }
         }
         else if (arg == "--replacefilename") {
             if (!infile2.empty() || i+1 >= argc) {
-                std::cerr << "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n";
+                std::cerr << USAGE;
                 return 18;
             }
             infile2 = argv[++i];
-            if (infile2.empty()) { std::cerr << "Usage: ./uqfaceclient portnum ...\n"; return 18; }
+            if (infile2.empty()) { std::cerr << USAGE; return 18; }
         }
         else if (arg == "--detect") {
             if (!infile1.empty() || i+1 >= argc) {
-                std::cerr << "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n";
+                std::cerr << USAGE;
                 return 18;
             }
             infile1 = argv[++i];
-            if (infile1.empty()) { std::cerr << "Usage: ./uqfaceclient portnum ...\n"; return 18; }
+            if (infile1.empty()) { std::cerr << USAGE; return 18; }
+        }
+        else if (arg == "--rects") {
+            if (rects) {
+                std::cerr << USAGE;
+                return 18;
+            }
+            rects = true;
+        }
+        else if (arg == "--overlay" || arg == "--register") {
+            std::string& value = (arg == "--overlay") ? handle_str : regfile;
+            if (!value.empty() || i+1 >= argc) {
+                std::cerr << USAGE;
+                return 18;
+            }
+            value = argv[++i];
+            if (value.empty()) { std::cerr << USAGE; return 18; }
+        }
+        else if (arg == "--detectsize" || arg == "--scalefactor" || arg == "--minneighbors"
+                 || arg == "--minface" || arg == "--maxface" || arg == "--jpegquality"
+                 || arg == "--pnglevel" || arg == "--webpquality") {
+            // Range checks are left to the server, which enforces its own bounds
+            uint8_t key = arg == "--detectsize" ? PARAM_DETECT_SIZE
+                        : arg == "--scalefactor" ? PARAM_SCALE_FACTOR
+                        : arg == "--minneighbors" ? PARAM_MIN_NEIGHBORS
+                        : arg == "--minface" ? PARAM_MIN_FACE
+                        : arg == "--maxface" ? PARAM_MAX_FACE
+                        : arg == "--jpegquality" ? PARAM_JPEG_QUALITY
+                        : arg == "--pnglevel" ? PARAM_PNG_LEVEL : PARAM_WEBP_QUALITY;
+            uint32_t value;
+            if (i+1 >= argc || !parse_param_value(argv[++i], key == PARAM_SCALE_FACTOR ? 1000 : 1, value)) {
+                std::cerr << USAGE;
+                return 18;
+            }
+            append_param(params, key, value);
+        }
+        else if (arg == "--backend") {
+            std::string name = i+1 < argc ? argv[++i] : "";
+            if (name != "haar" && name != "lbp" && name != "yunet") {
+                std::cerr << USAGE;
+                return 18;
+            }
+            append_param(params, PARAM_BACKEND, name == "haar" ? 0 : name == "lbp" ? 1 : 2);
+        }
+        else if (arg == "--format") {
+            std::string name = i+1 < argc ? argv[++i] : "";
+            if (name != "jpeg" && name != "png" && name != "webp") {
+                std::cerr << USAGE;
+                return 18;
+            }
+            append_param(params, PARAM_FORMAT, name == "jpeg" ? 0 : name == "png" ? 1 : 2);
+        }
+        else if (arg == "--jpegoptimize") {
+            jpeg_flags |= JPEG_OPTIMIZE;
+        }
+        else if (arg == "--jpegprogressive") {
+            jpeg_flags |= JPEG_PROGRESSIVE;
+        }
+        else if (arg == "--largest" || arg == "--noeyes") {
+            append_param(params, arg == "--largest" ? PARAM_LARGEST_FACE : PARAM_SKIP_EYES, 1);
+        }
+        else if (arg == "--pipeline") {
+            if (!pipeline.empty() || i+1 >= argc) {
+                std::cerr << USAGE;
+                return 18;
+            }
+            while (i+1 < argc && strncmp(argv[i+1], "--", 2) != 0) {
+                pipeline.push_back(argv[++i]);
+                if (pipeline.back().empty()) { std::cerr << USAGE; return 18; }
+            }
+            if (pipeline.empty()) { std::cerr << USAGE; return 18; }
         }
         else {
-            std::cerr << "Usage: ./uqfaceclient portnum [--outputimage filename] [--replacefilename filename] [--detect filename]\n";
+            std::cerr << USAGE;
+            return 18;
+        }
+    }
+    if (jpeg_flags != 0) append_param(params, PARAM_JPEG_FLAGS, jpeg_flags);
+    // Rectangles are only available for plain detection
+    if (rects && !infile2.empty()) {
+        std::cerr << USAGE;
+        return 18;
+    }
+    // A pipeline names its own inputs and outputs
+    if (!pipeline.empty() && (!infile1.empty() || !outfile.empty())) {
+        std::cerr << USAGE;
+        return 18;
+    }
+    // The overlay is either sent or named by its handle
+    uint64_t handle = 0;
+    if (!handle_str.empty()) {
+        char *end;
+        errno = 0;
+        handle = strtoull(handle_str.c_str(), &end, 16);
+        if (*end != '\0' || errno != 0 || !infile2.empty() || rects) {
+            std::cerr << USAGE;
             return 18;
         }
     }
+    // Registering an overlay is a request of its own
+    if (!regfile.empty() && (!infile1.empty() || !infile2.empty() || !handle_str.empty()
+                             || rects || !pipeline.empty())) {
+        std::cerr << USAGE;
+        return 18;
+    }
 
     // Open input files if given
     std::vector<char> img1_data, img2_data;
-    if (!infile1.empty()) {
-        std::ifstream in1(infile1, std::ios::binary);
-        if (!in1) {
-            std::cerr << "uqfaceclient: cannot open the input file \"" << infile1 << "\" for reading\n";
+    std::vector<std::vector<char>> pipeline_data(pipeline.size());
+    for (size_t i = 0; i < pipeline.size(); ++i) {
+        if (!read_file(pipeline[i], pipeline_data[i])) {
+            std::cerr << "uqfaceclient: cannot open the input file \"" << pipeline[i] << "\" for reading\n";
             return 11;
         }
-        img1_data.assign(std::istreambuf_iterator<char>(in1), {});
-        in1.close();
-    } else {
+    }
+    if (!infile1.empty() || !regfile.empty()) {
+        const std::string& name = regfile.empty() ? infile1 : regfile;
+        if (!read_file(name, img1_data)) {
+            std::cerr << "uqfaceclient: cannot open the input file \"" << name << "\" for reading\n";
+            return 11;
+        }
+    } else if (pipeline.empty()) {
         // Read from stdin
         std::vector<char> buf(4096);
         while (true) {
@@ -73,14 +354,14 @@ int main(int argc, char *argv[]) {
             if (!std::cin || n == 0) break;
         }
     }
-    if (!infile2.empty()) {
-        std::ifstream in2(infile2, std::ios::binary);
-        if (!in2) {
-            std::cerr << "uqfaceclient: cannot open the input file \"" << infile2 << "\" for reading\n";
-            return 11;
-        }
-        img2_data.assign(std::istreambuf_iterator<char>(in2), {});
-        in2.close();
+    if (!infile2.empty() && !read_file(infile2, img2_data)) {
+        std::cerr << "uqfaceclient: cannot open the input file \"" << infile2 << "\" for reading\n";
+        return 11;
+    }
+    if (!handle_str.empty()) {
+        // Sent in place of the overlay image
+        img2_data.resize(OVERLAY_HANDLE_SIZE);
+        put_le64(img2_data.data(), handle);
     }
 
     // Open output file if given
@@ -112,76 +393,87 @@ int main(int argc, char *argv[]) {
     }
     freeaddrinfo(res);
 
-    // Construct request
-    uint32_t prefix_le = PROTOCOL_PREFIX;
-    send_all(sockfd, (char*)&prefix_le, 4);
-    char op = img2_data.empty() ? OP_FACE_DETECT : OP_FACE_REPLACE;
-    send_all(sockfd, &op, 1);
+    char op = !regfile.empty() ? OP_REGISTER_OVERLAY
+            : rects ? OP_FACE_RECTS
+            : !handle_str.empty() ? OP_FACE_REPLACE_HANDLE
+            : img2_data.empty() ? OP_FACE_DETECT : OP_FACE_REPLACE;
+    if (!pipeline.empty()) {
+        return run_pipeline(sockfd, op, pipeline, pipeline_data, img2_data, params);
+    }
 
-    // Send image1
+    // Construct request: header, image1 and (for replace) image2 are
+    // written together in a single sendmsg()
     uint32_t size1 = img1_data.size();
-    char lenbuf[4] = { (char)(size1&0xFF), (char)(size1>>8), (char)(size1>>16), (char)(size1>>24) };
-    send_all(sockfd, lenbuf, 4);
-    if (size1 > 0) send_all(sockfd, img1_data.data(), size1);
-
+    std::vector<char> header = request_header(op, false, 0, params, size1);
+    uint32_t size2 = img2_data.size();
+    char lenbuf2[4];
+    put_le32(lenbuf2, size2);
+    iovec iov[4];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = header.data();
+    iov[iovcnt++].iov_len = header.size();
+    iov[iovcnt].iov_base = img1_data.data();
+    iov[iovcnt++].iov_len = size1;
     // If replace, send image2
     if (!img2_data.empty()) {
-        uint32_t size2 = img2_data.size();
-        char lenbuf2[4] = { (char)(size2&0xFF), (char)(size2>>8), (char)(size2>>16), (char)(size2>>24) };
-        send_all(sockfd, lenbuf2, 4);
-        send_all(sockfd, img2_data.data(), size2);
+        iov[iovcnt].iov_base = lenbuf2;
+        iov[iovcnt++].iov_len = 4;
+        iov[iovcnt].iov_base = img2_data.data();
+        iov[iovcnt++].iov_len = size2;
     }
+    send_iov(sockfd, iov, iovcnt);
 
-    // Receive response
-    char resp_prefix_buf[4];
-    if (!recv_all(sockfd, resp_prefix_buf, 4)) {
-        std::cerr << "uqfaceclient: a communication error occurred\n";
-        return 10;
-    }
-    uint32_t resp_prefix = (uint32_t)(uint8_t)resp_prefix_buf[0] 
-                        | (uint32_t)(uint8_t)resp_prefix_buf[1] << 8
-                        | (uint32_t)(uint8_t)resp_prefix_buf[2] << 16
-                        | (uint32_t)(uint8_t)resp_prefix_buf[3] << 24;
-    if (resp_prefix != PROTOCOL_PREFIX) {
-        std::cerr << "uqfaceclient: a communication error occurred\n";
-        return 10;
-    }
-    char resp_op;
-    if (!recv_all(sockfd, &resp_op, 1)) {
-        std::cerr << "uqfaceclient: a communication error occurred\n";
-        return 10;
-    }
-    // Read length
-    char resp_lenbuf[4];
-    if (!recv_all(sockfd, resp_lenbuf, 4)) {
-        std::cerr << "uqfaceclient: a communication error occurred\n";
-        return 10;
-    }
-    uint32_t resp_size = (uint32_t)(uint8_t)resp_lenbuf[0] 
-                      | (uint32_t)(uint8_t)resp_lenbuf[1] << 8
-                      | (uint32_t)(uint8_t)resp_lenbuf[2] << 16
-                      | (uint32_t)(uint8_t)resp_lenbuf[3] << 24;
-    // Read payload
-    std::vector<char> resp_data(resp_size);
-    if (resp_size > 0 && !recv_all(sockfd, resp_data.data(), resp_size)) {
+    // Receive response: header and payload come through one read-ahead
+    // buffer, so a small reply needs a single recv()
+    FrameReader reader(0, 0, false);
+    FrameInfo info;
+    FrameStatus status;
+    if (!reader.read_frame(sockfd, info, status) || status != FRAME_COMPLETE) {
         std::cerr << "uqfaceclient: a communication error occurred\n";
         return 10;
     }
+    char resp_op = info.op;
+    uint32_t resp_size = info.size[0];
+    const char *resp_data = reader.data() + info.offset[0];
 
     if (resp_op == OP_OUTPUT_IMAGE) {
         // Write image data to output
         if (!outfile.empty()) {
-            out.write(resp_data.data(), resp_size);
+            out.write(resp_data, resp_size);
             out.close();
         } else {
             // stdout (binary)
-            std::cout.write(resp_data.data(), resp_size);
+            std::cout.write(resp_data, resp_size);
+        }
+        close(sockfd);
+        return 0;
+    }
+    else if (resp_op == OP_DETECTIONS) {
+        // Print the boxes to the output file or stdout
+        std::ostream& dest = outfile.empty() ? std::cout : out;
+        if (!print_detections(dest, resp_data, resp_size)) {
+            std::cerr << "uqfaceclient: a communication error occurred\n";
+            close(sockfd);
+            return 10;
         }
         close(sockfd);
         return 0;
     }
+    else if (resp_op == OP_OVERLAY_HANDLE && resp_size == OVERLAY_HANDLE_SIZE) {
+        // Printed in the form --overlay accepts
+        std::ostream& dest = outfile.empty() ? std::cout : out;
+        dest << std::hex << std::setw(16) << std::setfill('0') << get_le64(resp_data) << "\n";
+        close(sockfd);
+        return 0;
+    }
+    else if (resp_op == OP_SERVER_BUSY && resp_size >= 4) {
+        uint32_t retry_ms = get_le32(resp_data);
+        std::cerr << "uqfaceclient: server busy, retry after " << retry_ms << " ms\n";
+        close(sockfd);
+        return 19;
+    }
     else if (resp_op == OP_ERROR_MESSAGE) {
-        std::string msg(resp_data.data(), resp_size);
+        std::string msg(resp_data, resp_size);
         std::cerr << "uqfaceclient: got the following error message: \"" << msg << "\"\n";
         close(sockfd);
         return 20;
@@ -1,5 +1,5 @@
 // uqfacedetect.cpp
-// Face detection server (multithreaded), using OpenCV and custom protocol.
+// Face detection server (epoll reactor + worker pool), using OpenCV and custom protocol.
 
 #include <iostream>
 #include <thread>
@@ -7,32 +7,124 @@
 #include <csignal>
 #include <vector>
 #include <atomic>
-#include <semaphore.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <random>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/resource.h>
 #include "protocol.h"
+#include "cache.h"
+#include "composite.h"
+#include "detector.h"
+#include "overlay.h"
+#include "params.h"
+#include "pipeline.h"
+#include "encode.h"
+#include "matalloc.h"
+#include "reactor.h"
+#include "stats.h"
+#include "workerpool.h"
 #include <opencv2/opencv.hpp>
 
 
-const std::string TMPFILE = "/tmp/imagefile.jpg";
+static const char *USAGE =
+    "Usage: ./uqfacedetect connectionlimit maxsize [portnum] [--maxbatch bytes]\n"
+    "       [--queuedepth n] [--queuewait ms]\n"
+    "       [--zerocopy minbytes] [--cachesize bytes] [--detcachesize bytes]\n"
+    "       [--overlaysize bytes] [--detectsize px] [--minface px] [--backend haar|lbp|yunet]\n"
+    "       [--yunetmodel file.onnx] [--format jpeg|png|webp] [--jpegquality n]\n"
+    "       [--jpegoptimize] [--jpegprogressive] [--pnglevel n] [--webpquality n]\n"
+    "       [--bufpool bytes] [--imagepool bytes] [--imagepoolmax bytes] [--hugepages]\n"
+    "       [--decodethreads n] [--detectthreads n] [--renderthreads n] [--encodethreads n]\n"
+    "       [--stagequeue n] [--tilepixels n] [--tilesize px]\n";
+
+// Default batch payload limit, in multiples of maxsize
+static const unsigned long DEFAULT_BATCH_IMAGES = 4;
+
+// Defaults for the admission queue
+static const unsigned long DEFAULT_QUEUE_DEPTH = 256;
+static const unsigned long DEFAULT_QUEUE_WAIT_MS = 0;  // 0 = wait forever
+
+// Default byte budget of the result cache
+static const unsigned long DEFAULT_CACHE_BYTES = 64UL << 20;
+// ... and of the detection cache (a few hundred bytes per image)
+static const unsigned long DEFAULT_DETECTION_CACHE_BYTES = 8UL << 20;
+// ... and of the registered overlays
+static const unsigned long DEFAULT_OVERLAY_BYTES = 64UL << 20;
+// Default number of jobs waiting between two pipeline stages. Each holds
+// a decoded image, so this bounds memory as well as latency.
+static const unsigned long DEFAULT_STAGE_QUEUE_DEPTH = 16;
+// Default size from which images are searched for faces in tiles, and
+// tile side: a tile's detection buffers fit in a typical L2/L3 cache
+static const unsigned long DEFAULT_TILE_PIXELS = 16UL << 20;
+static const unsigned long DEFAULT_TILE_SIDE = 1024;
+// Default limit on idle pooled receive buffers
+static const unsigned long DEFAULT_BUFFER_POOL_BYTES = 256UL << 20;
+// ... and on idle pooled image (cv::Mat) buffers: 0, pooling off, as it
+// has not measurably lowered memory or latency over OpenCV's allocator
+static const unsigned long DEFAULT_IMAGE_POOL_BYTES = 0;
+// Most pooled image bytes in use at once, when pooling is on
+static const unsigned long DEFAULT_IMAGE_POOL_MAX_USED = 1UL << 30;
 
 // Global stats and synchronization
 std::atomic<int> active_clients{0}, completed_clients{0};
 std::atomic<int> detect_requests{0}, replace_requests{0}, invalid_requests{0};
-sem_t file_sem, cascade_sem;
+std::atomic<int> rects_requests{0}, batch_requests{0};
+std::atomic<int> queue_depth{0}, queue_peak{0};
+std::atomic<int> rejected_full{0}, rejected_expired{0}, busy_connections{0};
+std::atomic<uint64_t> dequeued_requests{0}, queue_wait_total_us{0}, queue_wait_max_us{0};
+std::atomic<uint32_t> retry_after_hint_ms{100};
+std::atomic<uint64_t> zerocopy_sends{0}, zerocopy_copied{0};
+std::atomic<uint64_t> cache_hits{0}, cache_misses{0}, cache_evictions{0};
+std::atomic<uint64_t> det_cache_hits{0}, det_cache_misses{0}, det_cache_evictions{0};
+std::atomic<uint64_t> overlay_hits{0}, overlay_misses{0}, overlay_evictions{0};
+std::atomic<uint64_t> overlay_registrations{0};
+std::atomic<uint64_t> tiled_detections{0}, detection_tiles{0};
+// Output images encoded, time spent and bytes produced, per OutputFormat
+std::atomic<uint64_t> encode_count[NUM_FORMATS], encode_total_us[NUM_FORMATS];
+std::atomic<uint64_t> encode_bytes[NUM_FORMATS];
+
+// Request pipeline (created in main). Receiving and sending are done by
+// the reactor thread; the stages in between each have their own threads.
+enum StageId { STAGE_DECODE, STAGE_DETECT, STAGE_RENDER, STAGE_ENCODE, NUM_STAGES };
+static const char *const STAGE_NAMES[NUM_STAGES] = { "decode", "detect", "render", "encode" };
+std::unique_ptr<Stage> stages[NUM_STAGES];
+
+// Images with more detection pixels than tile_pixels (0 = none) are
+// searched in tiles tile_side pixels square (see detect_tiled())
+unsigned long tile_pixels, tile_side;
+
+// Detector models (read once, instantiated per detect worker)
+DetectorModels detector_models;
 
-// Haar cascades (loaded once)
-cv::CascadeClassifier face_cascade, eyes_cascade;
+// Encoded replies to recently seen requests
+ResultCache result_cache(cache_hits, cache_misses, cache_evictions);
+
+// Face and eye rectangles of recently seen images, shared by all operations
+ShardedLru<Detections> detection_cache(det_cache_hits, det_cache_misses, det_cache_evictions);
+
+// Decoded, premultiplied overlays registered by clients. Few, large and
+// rarely written, so one shard: any overlay within the budget fits
+OverlayRegistry overlay_registry(overlay_hits, overlay_misses, overlay_evictions, 1);
+
+// Secret seed of overlay handles, chosen at start-up so that a handle
+// cannot be computed from the image alone
+static const uint64_t overlay_seed = (uint64_t)std::random_device()() << 32 | std::random_device()();
 
 // Signal handling thread: waits for SIGHUP and prints stats
 void sighup_thread_func() {
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
-    // Unblock SIGHUP in this thread only
-    pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    // SIGHUP stays blocked in every thread (main blocks it before starting
+    // any); sigwait() picks it up here.
 
     while (true) {
         int sig;
@@ -43,302 +135,1024 @@ void sighup_thread_func() {
                       << "Completed clients: " << completed_clients.load() << "\n"
                       << "Face detection requests: " << detect_requests.load() << "\n"
                       << "Face replace requests: " << replace_requests.load() << "\n"
+                      << "Detections-only requests: " << rects_requests.load() << "\n"
+                      << "Batch requests: " << batch_requests.load() << "\n"
                       << "Invalid requests: " << invalid_requests.load() << "\n";
+            uint64_t dequeued = dequeued_requests.load();
+            uint64_t wait_avg_us = dequeued ? queue_wait_total_us.load() / dequeued : 0;
+            std::cerr << "Queue depth: " << queue_depth.load() << " (peak " << queue_peak.load() << ")\n"
+                      << "Queue wait: avg " << wait_avg_us / 1000.0 << " ms, max "
+                      << queue_wait_max_us.load() / 1000.0 << " ms\n"
+                      << "Rejected requests (queue full): " << rejected_full.load() << "\n"
+                      << "Rejected requests (queue wait exceeded): " << rejected_expired.load() << "\n"
+                      << "Rejected connections (connection limit): " << busy_connections.load() << "\n"
+                      << "Zero-copy sends: " << zerocopy_sends.load()
+                      << " (copied by kernel: " << zerocopy_copied.load() << ")\n"
+                      << "Result cache: " << cache_hits.load() << " hits, "
+                      << cache_misses.load() << " misses, " << cache_evictions.load()
+                      << " evictions (" << result_cache.entries() << " entries, "
+                      << result_cache.bytes() << " bytes)\n"
+                      << "Detection cache: " << det_cache_hits.load() << " hits, "
+                      << det_cache_misses.load() << " misses, " << det_cache_evictions.load()
+                      << " evictions (" << detection_cache.entries() << " entries)\n"
+                      << "Overlays: " << overlay_registrations.load() << " registered, "
+                      << overlay_hits.load() << " lookups found, " << overlay_misses.load()
+                      << " not found, " << overlay_evictions.load() << " evicted ("
+                      << overlay_registry.entries() << " kept, " << overlay_registry.bytes()
+                      << " bytes)\n";
+            uint64_t pool_hits = receive_buffers.hits(), pool_misses = receive_buffers.misses();
+            std::cerr << "Receive buffers: " << pool_hits << " reused, " << pool_misses
+                      << " allocated (hit rate "
+                      << (pool_hits + pool_misses ? 100.0 * pool_hits / (pool_hits + pool_misses) : 0.0)
+                      << "%), " << receive_buffers.used_bytes() << " bytes in use, "
+                      << receive_buffers.idle_bytes() << " bytes idle\n";
+            pool_hits = image_buffers.hits();
+            pool_misses = image_buffers.misses();
+            std::cerr << "Image buffers: " << pool_hits << " reused, " << pool_misses
+                      << " allocated (hit rate "
+                      << (pool_hits + pool_misses ? 100.0 * pool_hits / (pool_hits + pool_misses) : 0.0)
+                      << "%), " << small_mat_allocs.load() << " small, "
+                      << image_buffers.over_cap() << " over cap, "
+                      << image_buffers.used_bytes() << " bytes in use, "
+                      << image_buffers.idle_bytes() << " bytes idle\n";
+            std::cerr << "Tiled detections: " << tiled_detections.load() << " images, "
+                      << detection_tiles.load() << " tiles\n";
+            for (auto& stage : stages) {
+                if (!stage) continue;
+                uint64_t n = stage->processed();
+                std::cerr << "Stage " << stage->name() << ": " << stage->threads() << " threads, queue "
+                          << stage->depth() << " (peak " << stage->peak() << "), " << n
+                          << " jobs, avg wait " << (n ? stage->wait_us() / n / 1000.0 : 0.0)
+                          << " ms, avg service " << (n ? stage->service_us() / n / 1000.0 : 0.0)
+                          << " ms, " << stage->pool().steals() << " subtasks stolen\n";
+            }
+            for (int f = 0; f < NUM_FORMATS; ++f) {
+                uint64_t n = encode_count[f].load();
+                std::cerr << "Encoded " << format_name(f) << ": " << n << " images, avg "
+                          << (n ? encode_total_us[f].load() / n / 1000.0 : 0.0) << " ms, avg "
+                          << (n ? encode_bytes[f].load() / n : 0) << " bytes\n";
+            }
             std::cerr.flush();
         }
     }
 }
 
-// Thread function to handle one client
-void handle_client(int client_fd, uint32_t maxsize) {
-    active_clients.fetch_add(1);
-    char header[4], opcode;
-    while (true) {
-        // Read 4-byte prefix
-        if (!recv_all(client_fd, header, 4)) {
-            break; // EOF or error
-        }
-        uint32_t prefix = (uint32_t)(uint8_t)header[0] 
-                        | (uint32_t)(uint8_t)header[1] << 8
-                        | (uint32_t)(uint8_t)header[2] << 16
-                        | (uint32_t)(uint8_t)header[3] << 24;
-        if (prefix != PROTOCOL_PREFIX) {
-            // Bad prefix: send response file contents (not using protocol) and exit:contentReference[oaicite:29]{index=29}
-            invalid_requests.fetch_add(1);
-            // In a real assignment environment, read the provided response file.
-            // Here we simply close the connection.
-            break;
-        }
-        // Read operation code
-        if (!recv_all(client_fd, &opcode, 1)) break;
-        if (opcode != OP_FACE_DETECT && opcode != OP_FACE_REPLACE) {
-            // Invalid op
-            std::string err = "invalid operation type";
-            // Send error message
-            uint32_t len = err.size();
-            uint32_t prefix_le = PROTOCOL_PREFIX;
-            // Prefix
-            send_all(client_fd, (char*)&prefix_le, 4);
-            // Op = error
-            char op = OP_ERROR_MESSAGE;
-            send_all(client_fd, &op, 1);
-            // Length and message
-            char lenbuf[4] = { (char)(len&0xFF), (char)(len>>8), (char)(len>>16), (char)(len>>24) };
-            send_all(client_fd, lenbuf, 4);
-            send_all(client_fd, err.c_str(), len);
-            break;
-        }
-        bool isReplace = (opcode == OP_FACE_REPLACE);
-        // Read size of first image (little-endian)
-        char sizebuf[4];
-        if (!recv_all(client_fd, sizebuf, 4)) break;
-        uint32_t img1_size = (uint32_t)(uint8_t)sizebuf[0] 
-                           | (uint32_t)(uint8_t)sizebuf[1] << 8
-                           | (uint32_t)(uint8_t)sizebuf[2] << 16
-                           | (uint32_t)(uint8_t)sizebuf[3] << 24;
-        if (img1_size == 0) {
-            std::string err = "image is 0 bytes";
-            // send error (same protocol as above)
-            uint32_t prefix_le = PROTOCOL_PREFIX;
-            send_all(client_fd, (char*)&prefix_le, 4);
-            char op = OP_ERROR_MESSAGE;
-            send_all(client_fd, &op, 1);
-            char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-            send_all(client_fd, lenbuf, 4);
-            send_all(client_fd, err.c_str(), err.size());
-            break;
+// Fill in an error reply. The connection is closed once it has been sent.
+static void error_reply(Response& resp, const std::string& msg) {
+    resp.opcode = OP_ERROR_MESSAGE;
+    resp.payload.assign(msg.begin(), msg.end());
+    resp.close_after = true;
+}
+
+// Fill in a "server busy" reply carrying the current retry-after hint.
+// The connection stays open so the client can retry on it.
+static void busy_reply(Response& resp) {
+    resp.opcode = OP_SERVER_BUSY;
+    resp.payload.resize(4);
+    put_le32((char*)resp.payload.data(), retry_after_hint_ms.load());
+    static const char msg[] = "server busy";
+    resp.payload.insert(resp.payload.end(), msg, msg + sizeof(msg) - 1);
+}
+
+// Append a little-endian 32-bit value to a reply payload.
+static void append_le32(std::vector<unsigned char>& out, uint32_t v) {
+    char buf[4];
+    put_le32(buf, v);
+    out.insert(out.end(), buf, buf + 4);
+}
+
+// Append a rectangle as x, y, width, height, offset by (dx, dy).
+static void append_rect(std::vector<unsigned char>& out, const cv::Rect& r, int dx, int dy) {
+    append_le32(out, r.x + dx);
+    append_le32(out, r.y + dy);
+    append_le32(out, r.width);
+    append_le32(out, r.height);
+}
+
+// Raise an atomic maximum.
+template <typename T>
+static void atomic_max(std::atomic<T>& m, T v) {
+    T cur = m.load();
+    while (v > cur && !m.compare_exchange_weak(cur, v)) {
+    }
+}
+
+// Microseconds elapsed since t0.
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+}
+
+// Estimate how long a rejected client should back off: the time for the
+// pipeline to drain the current queue at the pace of its slowest stage.
+static void update_retry_hint() {
+    uint64_t per_item_us = 0;
+    for (auto& stage : stages) {
+        uint64_t n = stage->processed();
+        if (n == 0) continue;
+        per_item_us = std::max<uint64_t>(per_item_us, stage->service_us() / n / stage->threads());
+    }
+    if (per_item_us == 0) return;
+    uint64_t ms = per_item_us * (queue_depth.load() + 1) / 1000;
+    retry_after_hint_ms.store((uint32_t)std::max<uint64_t>(50, std::min<uint64_t>(ms, 30000)));
+}
+
+// Parse a non-negative decimal number no larger than max.
+static bool parse_number(const char *s, unsigned long max, unsigned long& out) {
+    if (!(*s == '+' || (*s >= '0' && *s <= '9'))) return false;
+    char *end;
+    errno = 0;
+    out = strtoul(s, &end, 10);
+    return *end == '\0' && errno == 0 && out <= max;
+}
+
+// The detect worker running a request, and the pool it can share
+// per-face work with. contexts holds one detector context per worker.
+struct Crew {
+    WorkerPool& pool;
+    std::vector<DetectorContext>& contexts;
+    unsigned worker;
+};
+
+// One image operation: a whole request, or one item of a batch. The image
+// bytes belong to the Request it was parsed from, which `owner` keeps alive.
+struct WorkItem {
+    std::shared_ptr<const Request> owner;
+    char op;
+    const unsigned char *img1, *img2;
+    size_t size1, size2;
+    RequestParams params;   // server defaults with the request's overrides
+};
+
+// Decode an image straight from received bytes (no copy is made).
+static cv::Mat decode_image(const unsigned char *data, size_t size) {
+    cv::Mat buf(1, (int)size, CV_8UC1, const_cast<unsigned char *>(data));
+    return cv::imdecode(buf, cv::IMREAD_UNCHANGED);
+}
+
+// Reduce a 16-bit image (e.g. some PNGs) to the 8 bits composite() needs.
+static void to_8bit(cv::Mat& image) {
+    if (image.depth() == CV_16U) image.convertTo(image, CV_8U, 1.0 / 256);
+}
+
+// Handle of an encoded overlay: a hash of its size and bytes, keyed with
+// this process's secret seed.
+static uint64_t overlay_handle(const unsigned char *data, size_t size) {
+    uint64_t size64 = size;
+    return hash_bytes(data, size, hash_bytes(&size64, sizeof(size64), overlay_seed));
+}
+
+// Decode and keep an overlay, answering with its handle. Registering an
+// image that is already kept just returns the handle again. An overlay
+// too large to keep is not the client's error: the connection stays open.
+static void register_overlay(const WorkItem& req, Response& resp) {
+    uint64_t handle = overlay_handle(req.img1, req.size1);
+    if (!overlay_registry.lookup(overlay_key(handle))) {
+        auto overlay = std::make_shared<cv::Mat>();
+        cv::Mat decoded = decode_image(req.img1, req.size1);
+        to_8bit(decoded);
+        if (!premultiply_overlay(decoded, *overlay)) {
+            error_reply(resp, "invalid image");
+            return;
         }
-        if (maxsize != 0 && img1_size > maxsize) {
-            std::string err = "image too large";
-            uint32_t prefix_le = PROTOCOL_PREFIX;
-            send_all(client_fd, (char*)&prefix_le, 4);
-            char op = OP_ERROR_MESSAGE;
-            send_all(client_fd, &op, 1);
-            char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-            send_all(client_fd, lenbuf, 4);
-            send_all(client_fd, err.c_str(), err.size());
-            break;
+        if (!overlay_registry.store(overlay_key(handle), overlay, overlay->total() * overlay->elemSize())) {
+            // Larger than the whole --overlaysize budget
+            error_reply(resp, "overlay too large");
+            resp.close_after = false;
+            return;
         }
-        // Receive image1 data
-        std::vector<uchar> img1_data(img1_size);
-        if (!recv_all(client_fd, (char*)img1_data.data(), img1_size)) break;
-
-        std::vector<uchar> img2_data;
-        uint32_t img2_size = 0;
-        if (isReplace) {
-            // Read second image size and data
-            if (!recv_all(client_fd, sizebuf, 4)) break;
-            img2_size = (uint32_t)(uint8_t)sizebuf[0] 
-                      | (uint32_t)(uint8_t)sizebuf[1] << 8
-                      | (uint32_t)(uint8_t)sizebuf[2] << 16
-                      | (uint32_t)(uint8_t)sizebuf[3] << 24;
-            if (img2_size == 0) {
-                std::string err = "image is 0 bytes";
-                uint32_t prefix_le = PROTOCOL_PREFIX;
-                send_all(client_fd, (char*)&prefix_le, 4);
-                char op = OP_ERROR_MESSAGE;
-                send_all(client_fd, &op, 1);
-                char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-                send_all(client_fd, lenbuf, 4);
-                send_all(client_fd, err.c_str(), err.size());
-                break;
+        overlay_registrations.fetch_add(1);
+    }
+    resp.opcode = OP_OVERLAY_HANDLE;
+    resp.payload.resize(OVERLAY_HANDLE_SIZE);
+    put_le64((char *)resp.payload.data(), handle);
+}
+
+// Scale a rectangle by (sx, sy), keeping it within an area of `bound`.
+static cv::Rect scale_rect(const cv::Rect& r, double sx, double sy, const cv::Size& bound) {
+    cv::Rect scaled(cvRound(r.x * sx), cvRound(r.y * sy),
+                    cvRound(r.width * sx), cvRound(r.height * sy));
+    return scaled & cv::Rect(0, 0, bound.width, bound.height);
+}
+
+// Find faces in a preprocessed image too large to search in one piece,
+// `scale` times the size of the original (see FaceDetector::detect()).
+// Faces up to a quarter tile wide are searched for in overlapping square
+// tiles, spread over idle detect workers; the overlap puts each such face
+// whole into at least one tile. Larger faces are searched for in one more
+// pass over a copy shrunk to tile_pixels. Faces found twice along the
+// seams are merged. A tile's pyramid and integral images stay small,
+// where a single search of a 50 MP image needs hundreds of megabytes.
+static void detect_tiled(const cv::Mat& input, const RequestParams& params, double scale,
+                         const Crew& crew, std::vector<cv::Rect>& faces,
+                         std::vector<std::vector<cv::Rect>> *eyes) {
+    int side = (int)tile_side, overlap = side / 4, stride = side - overlap;
+    // Tile origins along one side: a stride apart, the last flush with the edge
+    auto origins = [&](int length) {
+        std::vector<int> o;
+        for (int p = 0; ; p += stride) {
+            if (p + side >= length) {
+                o.push_back(std::max(0, length - side));
+                return o;
             }
-            if (maxsize != 0 && img2_size > maxsize) {
-                std::string err = "image too large";
-                uint32_t prefix_le = PROTOCOL_PREFIX;
-                send_all(client_fd, (char*)&prefix_le, 4);
-                char op = OP_ERROR_MESSAGE;
-                send_all(client_fd, &op, 1);
-                char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-                send_all(client_fd, lenbuf, 4);
-                send_all(client_fd, err.c_str(), err.size());
-                break;
+            o.push_back(p);
+        }
+    };
+    // The face width splitting the two passes, in original pixels
+    uint32_t split = (uint32_t)(overlap / scale);
+    RequestParams fine = params, coarse = params;
+    fine.max_face = params.max_face ? std::min(params.max_face, split) : split;
+    coarse.min_face = std::max(params.min_face, split);
+    std::vector<cv::Rect> tiles;
+    if (fine.max_face >= params.min_face) {
+        for (int y : origins(input.rows)) {
+            for (int x : origins(input.cols)) {
+                tiles.push_back(cv::Rect(x, y, std::min(side, input.cols - x),
+                                         std::min(side, input.rows - y)));
             }
-            img2_data.resize(img2_size);
-            if (!recv_all(client_fd, (char*)img2_data.data(), img2_size)) break;
         }
+    }
+    cv::Mat shrunk;
+    double f = std::sqrt((double)tile_pixels / input.total());
+    if (params.max_face == 0 || params.max_face > split) {
+        cv::Size size(std::max(1, cvRound(input.cols * f)), std::max(1, cvRound(input.rows * f)));
+        cv::resize(input, shrunk, size, 0, 0, cv::INTER_AREA);
+    }
+    size_t n = tiles.size() + !shrunk.empty();
+    tiled_detections.fetch_add(1);
+    detection_tiles.fetch_add(tiles.size());
 
-        // Save first image to file (protect with file_sem):contentReference[oaicite:30]{index=30}
-        sem_wait(&file_sem);
-        {
-            FILE *f = fopen(TMPFILE.c_str(), "wb");
-            if (f) {
-                fwrite(img1_data.data(), 1, img1_size, f);
-                fclose(f);
+    // Each part is searched with the detector of the worker that takes it
+    std::vector<std::vector<cv::Rect>> found(n);
+    std::vector<std::vector<std::vector<cv::Rect>>> found_eyes(eyes ? n : 0);
+    crew.pool.parallel_for(crew.worker, n, [&](unsigned worker, size_t i) {
+        FaceDetector& detector = *crew.contexts[worker].backends[params.backend];
+        std::vector<std::vector<cv::Rect>> *part_eyes = eyes ? &found_eyes[i] : nullptr;
+        if (i < tiles.size()) {
+            const cv::Rect& tile = tiles[i];
+            detector.detect(input(tile), fine, scale, found[i], part_eyes);
+            for (auto& face : found[i]) {
+                face.x += tile.x;
+                face.y += tile.y;
             }
+            return;
+        }
+        detector.detect(shrunk, coarse, scale * f, found[i], part_eyes);
+        for (size_t k = 0; k < found[i].size(); ++k) {
+            cv::Rect& face = found[i][k];
+            face = scale_rect(face, 1 / f, 1 / f, input.size());
+            if (!part_eyes) continue;
+            for (auto& eye : (*part_eyes)[k]) eye = scale_rect(eye, 1 / f, 1 / f, face.size());
+        }
+    });
+
+    faces.clear();
+    if (eyes) eyes->clear();
+    for (size_t i = 0; i < n; ++i) {
+        faces.insert(faces.end(), found[i].begin(), found[i].end());
+        if (eyes) eyes->insert(eyes->end(), found_eyes[i].begin(), found_eyes[i].end());
+    }
+    merge_duplicates(faces, eyes);
+    if (params.largest_face && faces.size() > 1) {
+        // Largest first after merging
+        faces.resize(1);
+        if (eyes) eyes->resize(1);
+    }
+}
+
+// No eyes searched for.
+static const std::vector<cv::Rect> NO_EYES;
+
+// Detect faces (and, if wanted, the eyes in each) in a decoded image, or
+// reuse the detections cached for the same image content under `key`. The
+// result lives in `own` or, when the cache is on, in `hold`.
+static const Detections& find_faces(const cv::Mat& image, const CacheKey& key,
+                                    const RequestParams& params, bool want_eyes, const Crew& crew,
+                                    Detections& own, std::shared_ptr<const Detections>& hold) {
+    DetectorContext& ctx = crew.contexts[crew.worker];
+    CacheKey image_key = { key.hash1, 0, key.size1, 0, 0, params.detection_variant() };
+    Detections *det = &own;
+    std::shared_ptr<Detections> fresh;
+    if (detection_cache.enabled()) {
+        hold = detection_cache.lookup(image_key);
+        if (hold && (hold->has_eyes || !want_eyes)) return *hold;
+        fresh = std::make_shared<Detections>();
+        det = fresh.get();
+    }
+    // Cascades run on one grayscale, equalized, possibly downscaled copy
+    // (YuNet on a colour one); (sx, sy) map its coordinates back to the image
+    FaceDetector& detector = *ctx.backends[params.backend];
+    const cv::Mat& gray = detector.wants_colour() ? preprocess_colour(image, params.detect_size, ctx)
+                                                  : preprocess(image, params.detect_size, ctx);
+    double sx = (double)image.cols / gray.cols, sy = (double)image.rows / gray.rows;
+    // Landmark eyes come with the faces, so a cached face list is no help
+    bool landmarks = want_eyes && detector.finds_eyes();
+    if (hold && !landmarks) {
+        // Cached by a replace request: only the eyes are missing
+        det->faces = hold->faces;
+    } else {
+        std::vector<std::vector<cv::Rect>> *eyes = landmarks ? &det->eyes : nullptr;
+        if (tile_pixels > 0 && gray.total() > tile_pixels) {
+            detect_tiled(gray, params, 1 / sx, crew, det->faces, eyes);
+        } else {
+            detector.detect(gray, params, 1 / sx, det->faces, eyes);
+        }
+        for (size_t i = 0; i < det->faces.size(); ++i) {
+            cv::Rect& face = det->faces[i];
+            face = scale_rect(face, sx, sy, image.size());
+            if (!landmarks) continue;
+            for (auto& eye : det->eyes[i]) eye = scale_rect(eye, sx, sy, face.size());
+        }
+    }
+    det->has_eyes = want_eyes;
+    if (want_eyes && !landmarks) {
+        det->eyes.resize(det->faces.size());
+        // Faces are independent: idle workers take some of them, each with
+        // its own eye cascade, reading the shared preprocessed image
+        crew.pool.parallel_for(crew.worker, det->faces.size(), [&](unsigned worker, size_t i) {
+            const cv::Rect& face = det->faces[i];
+            cv::Rect roi = scale_rect(face, 1 / sx, 1 / sy, gray.size());
+            std::vector<cv::Rect>& eyes = det->eyes[i];
+            eyes.clear();
+            if (roi.area() == 0) return;
+            detect_eyes(gray, roi, crew.contexts[worker], eyes);
+            for (auto& eye : eyes) eye = scale_rect(eye, sx, sy, face.size());
+        });
+    }
+    if (fresh) {
+        size_t cost = det->faces.size() * sizeof(cv::Rect);
+        for (auto& eyes : det->eyes) cost += sizeof(eyes) + eyes.size() * sizeof(cv::Rect);
+        hold = fresh;
+        detection_cache.store(image_key, hold, cost);
+    }
+    return *det;
+}
+
+// A work item on its way through the pipeline, with what each stage
+// leaves for the next. `more` is cleared by the stage that completes resp.
+struct Job {
+    WorkItem item;
+    std::function<void(Response&&)> done;   // receives the reply
+    std::chrono::steady_clock::time_point enqueued;
+    CacheKey key;           // see make_cache_key()
+    bool cache_reply;       // computed, not found in the result cache
+    cv::Mat image1, image2; // image2 only for OP_FACE_REPLACE
+    std::shared_ptr<const cv::Mat> overlay;
+    bool want_eyes;
+    Detections own;         // detections, unless found in the cache
+    std::shared_ptr<const Detections> hold;
+    const Detections *det;
+    Response resp;
+    bool more;
+
+    Job() : key(), cache_reply(false), want_eyes(false), det(nullptr), more(true) {}
+};
+
+// Decode stage: answer from the result cache, or decode the images. A
+// successful reply depends only on the request bytes, so a hit needs no
+// decoding or detection at all.
+static void decode_stage(Job& job) {
+    const WorkItem& req = job.item;
+    job.more = false;
+    if (req.op == OP_REGISTER_OVERLAY) {
+        register_overlay(req, job.resp);
+        return;
+    }
+    if (result_cache.enabled()) {
+        bool two = (req.op == OP_FACE_REPLACE || req.op == OP_FACE_REPLACE_HANDLE);
+        job.key = make_cache_key(req.op, req.img1, req.size1,
+                                 two ? req.img2 : nullptr, two ? req.size2 : 0, req.params.variant());
+        std::shared_ptr<const CachedReply> cached = result_cache.lookup(job.key);
+        if (cached) {
+            job.resp.opcode = cached->opcode;
+            job.resp.payload = cached->payload;
+            job.resp.close_after = cached->close_after;
+            return;
         }
-        sem_post(&file_sem);
-
-        // Load first image
-        cv::Mat image1 = cv::imread(TMPFILE, cv::IMREAD_UNCHANGED);
-        if (image1.empty()) {
-            // Invalid image
-            std::string err = "invalid image";
-            uint32_t prefix_le = PROTOCOL_PREFIX;
-            send_all(client_fd, (char*)&prefix_le, 4);
-            char op = OP_ERROR_MESSAGE;
-            send_all(client_fd, &op, 1);
-            char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-            send_all(client_fd, lenbuf, 4);
-            send_all(client_fd, err.c_str(), err.size());
-            break;
+        job.cache_reply = true;
+    } else if (detection_cache.enabled()) {
+        job.key = make_cache_key(req.op, req.img1, req.size1, nullptr, 0, 0);
+    }
+
+    // Decode first image straight from the received bytes
+    job.image1 = decode_image(req.img1, req.size1);
+    if (job.image1.empty()) {
+        // Invalid image
+        error_reply(job.resp, "invalid image");
+        return;
+    }
+    if (req.op == OP_FACE_REPLACE_HANDLE) {
+        job.overlay = overlay_registry.lookup(overlay_key(get_le64((const char *)req.img2)));
+        if (!job.overlay) {
+            // Not fatal: the client can register the overlay again
+            error_reply(job.resp, "unknown overlay handle");
+            job.resp.close_after = false;
+            return;
         }
+    } else if (req.op == OP_FACE_REPLACE) {
+        // Checked by render_stage(), after "no faces" has had its turn
+        job.image2 = decode_image(req.img2, req.size2);
+    }
+    job.more = true;
+}
+
+// Detect stage: find faces (and eyes, unless replacing or not wanted)
+// with this worker's own detectors, before anything is drawn on the
+// image. Every worker has its own detector context, so detection needs
+// no locking. Detections-only requests are answered here.
+static void detect_stage(Job& job, const Crew& crew) {
+    const WorkItem& req = job.item;
+    bool isReplace = (req.op == OP_FACE_REPLACE || req.op == OP_FACE_REPLACE_HANDLE);
+    job.want_eyes = !isReplace && !req.params.skip_eyes;
+    job.det = &find_faces(job.image1, job.key, req.params, job.want_eyes, crew, job.own, job.hold);
+    const std::vector<cv::Rect>& faces = job.det->faces;
+    job.more = false;
 
-        std::vector<cv::Rect> faces;
-        // Detect faces (thread-safe with cascade_sem):contentReference[oaicite:31]{index=31}
-        sem_wait(&cascade_sem);
-        face_cascade.detectMultiScale(image1, faces);
-        sem_post(&cascade_sem);
-        if (faces.empty()) {
-            // No faces found
-            std::string err = "no faces detected in image";
-            uint32_t prefix_le = PROTOCOL_PREFIX;
-            send_all(client_fd, (char*)&prefix_le, 4);
-            char op = OP_ERROR_MESSAGE;
-            send_all(client_fd, &op, 1);
-            char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-            send_all(client_fd, lenbuf, 4);
-            send_all(client_fd, err.c_str(), err.size());
-            break;
+    if (req.op == OP_FACE_RECTS) {
+        // Detections only: no drawing or encoding, and no faces is a valid answer
+        Response& resp = job.resp;
+        resp.opcode = OP_DETECTIONS;
+        append_le32(resp.payload, faces.size());
+        for (size_t i = 0; i < faces.size(); ++i) {
+            const cv::Rect& face = faces[i];
+            append_rect(resp.payload, face, 0, 0);
+            const std::vector<cv::Rect>& eyes = job.want_eyes ? job.det->eyes[i] : NO_EYES;
+            append_le32(resp.payload, eyes.size());
+            for (auto& eye : eyes) append_rect(resp.payload, eye, face.x, face.y);
         }
+        return;
+    }
+    if (faces.empty()) {
+        // No faces found
+        error_reply(job.resp, "no faces detected in image");
+        return;
+    }
+    job.more = true;
+}
 
-        if (!isReplace) {
-            // Face detection: draw ellipses on faces and eyes:contentReference[oaicite:32]{index=32}
-            sem_wait(&cascade_sem);
-            // For each face, detect eyes and draw ellipses
-            for (auto& face : faces) {
-                // Draw ellipse around face
-                cv::Point center(face.x + face.width/2, face.y + face.height/2);
-                cv::ellipse(image1, center, cv::Size(face.width/2, face.height/2), 0, 0, 360, cv::Scalar(0,255,0), 2);
-                // Detect eyes within face region
-                cv::Mat faceROI = image1(face);
-                std::vector<cv::Rect> eyes;
-                eyes_cascade.detectMultiScale(faceROI, eyes);
-                for (auto& eye : eyes) {
-                    cv::Point ecenter(face.x + eye.x + eye.width/2, face.y + eye.y + eye.height/2);
-                    int radius = cvRound((eye.width+eye.height)*0.25);
-                    cv::ellipse(image1, ecenter, cv::Size(radius, radius), 0, 0, 360, cv::Scalar(255,0,0), 2);
-                }
+// True if no two rectangles overlap, so that each can be drawn into by
+// a different thread.
+static bool disjoint(const std::vector<cv::Rect>& rects) {
+    for (size_t i = 0; i < rects.size(); ++i) {
+        for (size_t j = i + 1; j < rects.size(); ++j) {
+            if ((rects[i] & rects[j]).area() > 0) return false;
+        }
+    }
+    return true;
+}
+
+// Run body(w, i) for each face, spread over idle workers of `pool` when
+// the faces do not overlap. Returns false if any call did.
+static bool for_each_face(const std::vector<cv::Rect>& faces, WorkerPool& pool, unsigned worker,
+                          const std::function<bool(size_t)>& body) {
+    std::vector<char> ok(faces.size(), 1);
+    if (faces.size() > 1 && disjoint(faces)) {
+        pool.parallel_for(worker, faces.size(), [&](unsigned, size_t i) { ok[i] = body(i); });
+    } else {
+        for (size_t i = 0; i < faces.size(); ++i) ok[i] = body(i);
+    }
+    return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+// Render stage: mark or replace the faces in image1. Replacing scales an
+// overlay to every face, which for a group photo is spread over idle
+// render workers.
+static void render_stage(Job& job, WorkerPool& pool, unsigned worker) {
+    const WorkItem& req = job.item;
+    const Detections& det = *job.det;
+    const std::vector<cv::Rect>& faces = det.faces;
+    cv::Mat& image1 = job.image1;
+    job.more = false;
+
+    if (req.op != OP_FACE_REPLACE && req.op != OP_FACE_REPLACE_HANDLE) {
+        // Face detection: draw ellipses on faces and eyes:contentReference[oaicite:32]{index=32}
+        // For each face, draw ellipses around it and its eyes
+        for (size_t i = 0; i < faces.size(); ++i) {
+            const cv::Rect& face = faces[i];
+            // Draw ellipse around face
+            cv::Point center(face.x + face.width/2, face.y + face.height/2);
+            cv::ellipse(image1, center, cv::Size(face.width/2, face.height/2), 0, 0, 360, cv::Scalar(0,255,0), 2);
+            for (auto& eye : job.want_eyes ? det.eyes[i] : NO_EYES) {
+                cv::Point ecenter(face.x + eye.x + eye.width/2, face.y + eye.y + eye.height/2);
+                int radius = cvRound((eye.width+eye.height)*0.25);
+                cv::ellipse(image1, ecenter, cv::Size(radius, radius), 0, 0, 360, cv::Scalar(255,0,0), 2);
             }
-            sem_post(&cascade_sem);
-        } else {
-            // Face replacement: overlay second image on each face
-            cv::Mat image2;
-            // Save second image to file and load it
-            sem_wait(&file_sem);
-            {
-                FILE *f = fopen(TMPFILE.c_str(), "wb");
-                if (f) {
-                    fwrite(img2_data.data(), 1, img2_size, f);
-                    fclose(f);
+        }
+    } else if (job.overlay) {
+        // Face replacement with a registered overlay: already decoded
+        to_8bit(image1);
+        const cv::Mat& overlay = *job.overlay;
+        if (!for_each_face(faces, pool, worker, [&](size_t i) {
+                return blend_overlay(image1, faces[i], overlay);
+            })) {
+            error_reply(job.resp, "unsupported image format");
+            return;
+        }
+    } else {
+        // Face replacement: overlay second image on each face
+        cv::Mat& image2 = job.image2;
+        if (image2.empty()) {
+            error_reply(job.resp, "invalid image");
+            return;
+        }
+        to_8bit(image1);
+        to_8bit(image2);
+        if (image2.channels() == 1) cv::cvtColor(image2, image2, cv::COLOR_GRAY2BGR);
+        // Blend the overlay onto each face with its own alpha
+        if (!for_each_face(faces, pool, worker, [&](size_t i) {
+                cv::Mat resized;
+                cv::resize(image2, resized, faces[i].size());
+                return composite(image1, faces[i], resized, ALPHA_STRAIGHT);
+            })) {
+            error_reply(job.resp, "unsupported image format");
+            return;
+        }
+    }
+    job.more = true;
+}
+
+// Encode stage: encode the result in the requested format directly into
+// the reply (op=2, output image).
+static void encode_stage(Job& job) {
+    Response& resp = job.resp;
+    job.more = false;
+    resp.opcode = OP_OUTPUT_IMAGE;
+    auto started = std::chrono::steady_clock::now();
+    if (!encode_image(job.image1, job.item.params, resp.payload)) {
+        error_reply(resp, "unable to encode output image");
+        return;
+    }
+    uint32_t format = job.item.params.format;
+    encode_count[format].fetch_add(1);
+    encode_total_us[format].fetch_add(elapsed_us(started));
+    encode_bytes[format].fetch_add(resp.payload.size());
+}
+
+// Count a successfully answered work item.
+static void count_reply(const WorkItem& item, const Response& resp) {
+    if (resp.opcode == OP_DETECTIONS) rects_requests.fetch_add(1);
+    else if (resp.opcode != OP_OUTPUT_IMAGE) return;
+    else if (item.op == OP_FACE_REPLACE || item.op == OP_FACE_REPLACE_HANDLE) replace_requests.fetch_add(1);
+    else detect_requests.fetch_add(1);
+}
+
+// Add a computed reply to the result cache, count it and pass it on.
+// Errors are not cached: some (an unknown overlay handle) go away once
+// the client acts on them.
+static void finish_job(Job& job) {
+    Response& resp = job.resp;
+    if (job.cache_reply && (resp.opcode == OP_OUTPUT_IMAGE || resp.opcode == OP_DETECTIONS)) {
+        auto reply = std::make_shared<CachedReply>();
+        reply->opcode = resp.opcode;
+        reply->payload = resp.payload;
+        reply->close_after = resp.close_after;
+        result_cache.store(job.key, std::move(reply), resp.payload.size());
+    }
+    count_reply(job.item, resp);
+    job.done(std::move(resp));
+}
+
+// Results of a batch, filled in by whichever workers run its items. The
+// worker that finishes the last item assembles and posts the reply.
+struct BatchState {
+    std::shared_ptr<const Request> owner;
+    std::vector<Response> results;
+    std::atomic<size_t> remaining;
+};
+
+// Post the reply to `req`. A tagged request shares its connection with
+// others in flight, so an error answering it does not close the connection.
+static void post_reply(Reactor& reactor, const Request& req, Response&& resp) {
+    resp.tagged = req.tagged;
+    resp.request_id = req.request_id;
+    if (req.tagged) resp.close_after = false;
+    reactor.post_response(req.conn_id, std::move(resp));
+}
+
+// Routes complete requests from the reactor into the pipeline, applying
+// admission control and fanning batch items out as separate work items.
+class Dispatcher {
+public:
+    Dispatcher(Reactor& reactor, std::vector<DetectorContext>& contexts,
+               uint32_t maxsize, unsigned long queue_limit, unsigned long queue_wait_ms,
+               const RequestParams& defaults)
+        : reactor_(reactor), contexts_(contexts), maxsize_(maxsize),
+          queue_limit_(queue_limit), queue_wait_ms_(queue_wait_ms), defaults_(defaults) {}
+
+    // Called on the reactor thread for each complete request.
+    void on_request(Request&& req) {
+        auto owner = std::make_shared<const Request>(std::move(req));
+        RequestParams params = defaults_;
+        if (!owner->params.empty()) {
+            // The default minimum face is also the smallest a request may ask for
+            const char *err = parse_params(owner->params.data(), owner->params.size(),
+                                           defaults_.min_face, params);
+            if (!err && !detector_models.available(params.backend)) {
+                err = "detector backend not available";
+            }
+            if (err) {
+                invalid_request(*owner, err);
+                return;
+            }
+        }
+        if (owner->opcode == OP_BATCH_REQUEST) {
+            dispatch_batch(owner, params);
+            return;
+        }
+        if (!admit(1)) {
+            reject(*owner);
+            return;
+        }
+        WorkItem item = { owner, owner->opcode, owner->img1.data(), owner->img2.data(),
+                          owner->img1.size(), owner->img2.size(), params };
+        Reactor& reactor = reactor_;
+        enqueue(item, [&reactor, owner](Response&& resp) {
+            post_reply(reactor, *owner, std::move(resp));
+        });
+    }
+
+private:
+    typedef std::function<void(Response&&)> Done;
+
+    // Admission control: only the reactor thread adds to queue_depth, so
+    // this check cannot race with another submitter. A batch larger than
+    // the whole queue is still let into an empty queue.
+    bool admit(size_t n) {
+        int depth = queue_depth.load();
+        return depth == 0 || depth + n <= queue_limit_;
+    }
+
+    void reject(const Request& req) {
+        rejected_full.fetch_add(1);
+        Response resp;
+        busy_reply(resp);
+        post_reply(reactor_, req, std::move(resp));
+    }
+
+    // Queue one work item; `done` receives its reply on the thread of the
+    // stage that completes it.
+    void enqueue(const WorkItem& item, Done done) {
+        atomic_max(queue_peak, queue_depth.fetch_add(1) + 1);
+        auto job = std::make_shared<Job>();
+        job->item = item;
+        job->done = std::move(done);
+        job->enqueued = std::chrono::steady_clock::now();
+        advance(STAGE_DECODE, job);
+    }
+
+    // Queue a job for stage s. A stage hands the job on once it is done
+    // with it, which waits while the next stage's queue is full.
+    void advance(int s, const std::shared_ptr<Job>& job) {
+        Stage& stage = *stages[s];
+        std::vector<DetectorContext>& contexts = contexts_;
+        unsigned long queue_wait_ms = queue_wait_ms_;
+        stage.push([s, job, &stage, &contexts, queue_wait_ms](unsigned worker) {
+            switch (s) {
+            case STAGE_DECODE: {
+                // The decode queue is the admission queue
+                queue_depth.fetch_sub(1);
+                uint64_t waited = elapsed_us(job->enqueued);
+                dequeued_requests.fetch_add(1);
+                queue_wait_total_us.fetch_add(waited);
+                atomic_max(queue_wait_max_us, waited);
+                if (queue_wait_ms > 0 && waited > queue_wait_ms * 1000) {
+                    // Waited too long: the client has likely given up already
+                    rejected_expired.fetch_add(1);
+                    busy_reply(job->resp);
+                    job->more = false;
+                } else {
+                    decode_stage(*job);
                 }
+                break;
             }
-            sem_post(&file_sem);
-            image2 = cv::imread(TMPFILE, cv::IMREAD_UNCHANGED);
-            if (image2.empty()) {
-                std::string err = "invalid image";
-                uint32_t prefix_le = PROTOCOL_PREFIX;
-                send_all(client_fd, (char*)&prefix_le, 4);
-                char op = OP_ERROR_MESSAGE;
-                send_all(client_fd, &op, 1);
-                char lenbuf[4] = { (char)(err.size()&0xFF), (char)(err.size()>>8), (char)(err.size()>>16), (char)(err.size()>>24) };
-                send_all(client_fd, lenbuf, 4);
-                send_all(client_fd, err.c_str(), err.size());
+            case STAGE_DETECT:
+                detect_stage(*job, Crew { stage.pool(), contexts, worker });
+                break;
+            case STAGE_RENDER:
+                render_stage(*job, stage.pool(), worker);
+                break;
+            default:
+                encode_stage(*job);
                 break;
             }
-            // Overlay each face
-            for (auto& face : faces) {
-                cv::Mat resized;
-                cv::resize(image2, resized, face.size());
-                // Handle alpha channel if present
-                for (int y = 0; y < face.height; ++y) {
-                    for (int x = 0; x < face.width; ++x) {
-                        cv::Vec4b pix = resized.at<cv::Vec4b>(y, x);
-                        if (pix[3] > 0) { 
-                            // alpha > 0, copy BGR
-                            image1.at<cv::Vec3b>(face.y+y, face.x+x) = cv::Vec3b(pix[0], pix[1], pix[2]);
-                        }
-                    }
+        }, [this, s, job] {
+            if (job->more && s + 1 < NUM_STAGES) {
+                advance(s + 1, job);
+            } else {
+                update_retry_hint();
+                finish_job(*job);
+            }
+        });
+    }
+
+    // Split a batch into work items. Item images point into the batch
+    // payload; nothing is copied.
+    void dispatch_batch(const std::shared_ptr<const Request>& owner, const RequestParams& params) {
+        const unsigned char *p = owner->img1.data();
+        const unsigned char *end = p + owner->img1.size();
+        std::vector<WorkItem> items;
+        if (end - p < 4) {
+            invalid_request(*owner, "invalid batch");
+            return;
+        }
+        uint32_t count = get_le32((const char *)p);
+        p += 4;
+        if (count == 0 || count > MAX_BATCH_ITEMS) {
+            invalid_request(*owner, "invalid batch");
+            return;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - p < 1) {
+                invalid_request(*owner, "invalid batch");
+                return;
+            }
+            WorkItem item = { owner, (char)*p++, nullptr, nullptr, 0, 0, params };
+            int nimages;
+            switch (item.op) {
+            case OP_FACE_DETECT:
+            case OP_FACE_RECTS:  nimages = 1; break;
+            case OP_FACE_REPLACE:
+            case OP_FACE_REPLACE_HANDLE: nimages = 2; break;
+            default:
+                invalid_request(*owner, "invalid operation type");
+                return;
+            }
+            for (int j = 0; j < nimages; ++j) {
+                if (end - p < 4 || (size_t)(end - p - 4) < get_le32((const char *)p)) {
+                    invalid_request(*owner, "invalid batch");
+                    return;
                 }
+                size_t size = get_le32((const char *)p);
+                (j == 0 ? item.img1 : item.img2) = p + 4;
+                (j == 0 ? item.size1 : item.size2) = size;
+                p += 4 + size;
             }
+            items.push_back(item);
+        }
+        if (p != end) {
+            invalid_request(*owner, "invalid batch");
+            return;
+        }
+        if (!admit(count)) {
+            reject(*owner);
+            return;
         }
+        batch_requests.fetch_add(1);
 
-        // Write output image to file (overwrite) and send to client
-        sem_wait(&file_sem);
-        cv::imwrite(TMPFILE, image1);  // save result
-        sem_post(&file_sem);
-
-        // Read output file into buffer
-        std::vector<uchar> outbuf;
-        {
-            FILE *f = fopen(TMPFILE.c_str(), "rb");
-            if (f) {
-                fseek(f, 0, SEEK_END);
-                long outsz = ftell(f);
-                fseek(f, 0, SEEK_SET);
-                outbuf.resize(outsz);
-                fread(outbuf.data(), 1, outsz, f);
-                fclose(f);
+        auto batch = std::make_shared<BatchState>();
+        batch->owner = owner;
+        batch->results.resize(count);
+        batch->remaining = count;
+        Reactor& reactor = reactor_;
+        for (uint32_t i = 0; i < count; ++i) {
+            Done done = [batch, i, &reactor](Response&& resp) {
+                batch->results[i] = std::move(resp);
+                if (batch->remaining.fetch_sub(1) == 1) {
+                    post_batch(reactor, *batch);
+                }
+            };
+            // Per-item size problems only fail that item
+            const WorkItem& item = items[i];
+            const char *err = nullptr;
+            if (item.op == OP_FACE_REPLACE_HANDLE && item.size2 != OVERLAY_HANDLE_SIZE) {
+                err = "invalid overlay handle";
+            } else if (item.size1 == 0 || (item.img2 && item.size2 == 0)) {
+                err = "image is 0 bytes";
+            } else if (maxsize_ != 0 && (item.size1 > maxsize_ || item.size2 > maxsize_)) {
+                err = "image too large";
+            }
+            if (err) {
+                Response resp;
+                error_reply(resp, err);
+                done(std::move(resp));
+            } else {
+                enqueue(item, done);
             }
         }
+    }
 
-        // Send protocol message with op=2 (output image)
-        uint32_t prefix_le = PROTOCOL_PREFIX;
-        send_all(client_fd, (char*)&prefix_le, 4);
-        char op_out = OP_OUTPUT_IMAGE;
-        send_all(client_fd, &op_out, 1);
-        uint32_t outsz = outbuf.size();
-        char outlen[4] = { (char)(outsz&0xFF), (char)(outsz>>8), (char)(outsz>>16), (char)(outsz>>24) };
-        send_all(client_fd, outlen, 4);
-        send_all(client_fd, (char*)outbuf.data(), outsz);
-
-        // Increment request counters
-        if (isReplace) replace_requests.fetch_add(1);
-        else           detect_requests.fetch_add(1);
-        // Then loop for next request
-    }
-    close(client_fd);
-    active_clients.fetch_sub(1);
-    completed_clients.fetch_add(1);
-}
+    // A malformed request or batch gets an error reply, then the
+    // connection is closed. Nothing after it on the connection is read.
+    void invalid_request(const Request& req, const char *msg) {
+        reactor_.stop_reading(req.conn_id);
+        Response resp;
+        error_reply(resp, msg);
+        resp.tagged = req.tagged;
+        resp.request_id = req.request_id;
+        reactor_.post_response(req.conn_id, std::move(resp));
+    }
+
+    // Concatenate the item results into one OP_BATCH_RESPONSE.
+    static void post_batch(Reactor& reactor, BatchState& batch) {
+        Response resp;
+        resp.opcode = OP_BATCH_RESPONSE;
+        size_t total = 4;
+        for (auto& r : batch.results) total += 5 + r.payload.size();
+        resp.payload.reserve(total);
+        append_le32(resp.payload, batch.results.size());
+        for (auto& r : batch.results) {
+            resp.payload.push_back((unsigned char)r.opcode);
+            append_le32(resp.payload, r.payload.size());
+            resp.payload.insert(resp.payload.end(), r.payload.begin(), r.payload.end());
+        }
+        post_reply(reactor, *batch.owner, std::move(resp));
+    }
+
+    Reactor& reactor_;
+    std::vector<DetectorContext>& contexts_;
+    uint32_t maxsize_;
+    unsigned long queue_limit_;
+    unsigned long queue_wait_ms_;
+    RequestParams defaults_;
+};
 
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4) {
-        std::cerr << "Usage: ./uqfacedetect connectionlimit maxsize [portnum]\n";
+    // Positional arguments come first, then optional flags
+    int npos = 1;
+    while (npos < argc && strncmp(argv[npos], "--", 2) != 0) ++npos;
+    if (npos < 3 || npos > 4) {
+        std::cerr << USAGE;
         return 20;
     }
     // Parse connectionlimit and maxsize
     int connectionlimit = atoi(argv[1]);
     uint32_t maxsize = (uint32_t)strtoul(argv[2], nullptr, 10);
     if (connectionlimit < 0 || connectionlimit > 10000) {
-        std::cerr << "Usage: ./uqfacedetect connectionlimit maxsize [portnum]\n";
+        std::cerr << USAGE;
         return 20;
     }
     if ( (argv[2][0] == '+' || (argv[2][0] >= '0' && argv[2][0] <= '9')) == false ) {
-        std::cerr << "Usage: ./uqfacedetect connectionlimit maxsize [portnum]\n";
+        std::cerr << USAGE;
         return 20;
     }
-    std::string port_str = (argc == 4 ? argv[3] : "0");
+    std::string port_str = (npos == 4 ? argv[3] : "0");
     // Check port_str not empty
     if (port_str.empty()) {
-        std::cerr << "Usage: ./uqfacedetect connectionlimit maxsize [portnum]\n";
+        std::cerr << USAGE;
         return 20;
     }
-    // Test temporary file creation
-    FILE *testf = fopen(TMPFILE.c_str(), "wb");
-    if (!testf) {
-        std::cerr << "uqfacedetect: unable to open the image file for writing\n";
-        return 2;
+    // Batch payloads are limited separately: one header may not claim room
+    // for MAX_BATCH_ITEMS full-size images
+    unsigned long maxbatch = std::min((unsigned long)UINT32_MAX, DEFAULT_BATCH_IMAGES * maxsize);
+    unsigned long queue_limit = DEFAULT_QUEUE_DEPTH;
+    unsigned long queue_wait_ms = DEFAULT_QUEUE_WAIT_MS;
+    unsigned long zerocopy_min = 0;
+    unsigned long cache_bytes = DEFAULT_CACHE_BYTES;
+    unsigned long detcache_bytes = DEFAULT_DETECTION_CACHE_BYTES;
+    unsigned long overlay_bytes = DEFAULT_OVERLAY_BYTES;
+    unsigned long detect_size = 0;
+    unsigned long min_face = 0;
+    unsigned long pool_bytes = DEFAULT_BUFFER_POOL_BYTES;
+    unsigned long image_pool_bytes = DEFAULT_IMAGE_POOL_BYTES;
+    unsigned long image_pool_max_used = DEFAULT_IMAGE_POOL_MAX_USED;
+    bool huge_pages = false;
+    // Pipeline threads per stage (0 = default) and queue between stages
+    unsigned long stage_threads[NUM_STAGES] = { 0, 0, 0, 0 };
+    unsigned long stage_queue = DEFAULT_STAGE_QUEUE_DEPTH;
+    tile_pixels = DEFAULT_TILE_PIXELS;
+    tile_side = DEFAULT_TILE_SIDE;
+    std::string backend_name = "haar";
+    std::string yunet_model = "";
+    std::string format_str = "jpeg";
+    unsigned long jpeg_quality = 95, png_level = 1, webp_quality = 101;
+    bool jpeg_optimize = false, jpeg_progressive = false;
+    for (int i = npos; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = (i + 1 < argc);
+        if (arg == "--maxbatch") {
+            ok = ok && parse_number(argv[++i], UINT32_MAX, maxbatch);
+        } else if (arg == "--queuedepth") {
+            ok = ok && parse_number(argv[++i], 1000000, queue_limit) && queue_limit > 0;
+        } else if (arg == "--queuewait") {
+            ok = ok && parse_number(argv[++i], 3600000, queue_wait_ms);
+        } else if (arg == "--zerocopy") {
+            ok = ok && parse_number(argv[++i], UINT32_MAX, zerocopy_min);
+        } else if (arg == "--cachesize") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, cache_bytes);
+        } else if (arg == "--detcachesize") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, detcache_bytes);
+        } else if (arg == "--overlaysize") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, overlay_bytes);
+        } else if (arg == "--bufpool") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, pool_bytes);
+        } else if (arg == "--imagepool") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, image_pool_bytes);
+        } else if (arg == "--imagepoolmax") {
+            ok = ok && parse_number(argv[++i], 1UL << 40, image_pool_max_used);
+        } else if (arg == "--hugepages") {
+            ok = huge_pages = true;
+        } else if (arg == "--decodethreads") {
+            ok = ok && parse_number(argv[++i], 1024, stage_threads[STAGE_DECODE]) && stage_threads[STAGE_DECODE] > 0;
+        } else if (arg == "--detectthreads") {
+            ok = ok && parse_number(argv[++i], 1024, stage_threads[STAGE_DETECT]) && stage_threads[STAGE_DETECT] > 0;
+        } else if (arg == "--renderthreads") {
+            ok = ok && parse_number(argv[++i], 1024, stage_threads[STAGE_RENDER]) && stage_threads[STAGE_RENDER] > 0;
+        } else if (arg == "--encodethreads") {
+            ok = ok && parse_number(argv[++i], 1024, stage_threads[STAGE_ENCODE]) && stage_threads[STAGE_ENCODE] > 0;
+        } else if (arg == "--stagequeue") {
+            ok = ok && parse_number(argv[++i], 1000000, stage_queue) && stage_queue > 0;
+        } else if (arg == "--tilepixels") {
+            ok = ok && parse_number(argv[++i], 1UL << 32, tile_pixels);
+        } else if (arg == "--tilesize") {
+            ok = ok && parse_number(argv[++i], 16384, tile_side) && tile_side >= 128;
+        } else if (arg == "--detectsize") {
+            ok = ok && parse_number(argv[++i], 65535, detect_size)
+                 && (detect_size == 0 || detect_size >= MIN_DETECT_SIZE);
+        } else if (arg == "--minface") {
+            ok = ok && parse_number(argv[++i], MAX_FACE_SIZE, min_face);
+        } else if (arg == "--backend") {
+            backend_name = argv[++i];
+            ok = ok && (backend_name == "haar" || backend_name == "lbp" || backend_name == "yunet");
+        } else if (arg == "--yunetmodel") {
+            yunet_model = argv[++i];
+            ok = ok && !yunet_model.empty();
+        } else if (arg == "--format") {
+            format_str = argv[++i];
+            ok = ok && (format_str == "jpeg" || format_str == "png" || format_str == "webp");
+        } else if (arg == "--jpegquality") {
+            ok = ok && parse_number(argv[++i], MAX_JPEG_QUALITY, jpeg_quality);
+        } else if (arg == "--pnglevel") {
+            ok = ok && parse_number(argv[++i], MAX_PNG_LEVEL, png_level);
+        } else if (arg == "--webpquality") {
+            ok = ok && parse_number(argv[++i], MAX_WEBP_QUALITY, webp_quality) && webp_quality > 0;
+        } else if (arg == "--jpegoptimize") {
+            ok = jpeg_optimize = true;
+        } else if (arg == "--jpegprogressive") {
+            ok = jpeg_progressive = true;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << USAGE;
+            return 20;
+        }
+    }
+    if (tile_pixels != 0 && tile_pixels < tile_side * tile_side) {
+        // Tiling an image smaller than one tile would gain nothing
+        std::cerr << USAGE;
+        return 20;
     }
-    fclose(testf);
+    // Pooled matrix data from here on, so the models below use it too
+    receive_buffers.set_huge_pages(huge_pages);
+    image_buffers.set_huge_pages(huge_pages);
+    image_buffers.set_limit(image_pool_bytes);
+    image_buffers.set_max_used(image_pool_max_used);
+    if (image_pool_bytes > 0) install_mat_allocator();
 
     // Load Haar cascades
     std::string face_cascade_name = "/usr/share/opencv4/haarcascades/haarcascade_frontalface_alt2.xml";
     std::string eyes_cascade_name = "/usr/share/opencv4/haarcascades/haarcascade_eye_tree_eyeglasses.xml";
-    if (!face_cascade.load(face_cascade_name) || !eyes_cascade.load(eyes_cascade_name)) {
+    if (!detector_models.load(face_cascade_name, eyes_cascade_name)) {
         std::cerr << "uqfacedetect: unable to load a cascade classifier\n";
         return 16;
     }
+    // Optional backends: LBP from the standard location, YuNet if given
+    detector_models.load_backend(BACKEND_LBP,
+        "/usr/share/opencv4/lbpcascades/lbpcascade_frontalface_improved.xml");
+    if (!yunet_model.empty() && !detector_models.load_backend(BACKEND_YUNET, yunet_model)) {
+        std::cerr << "uqfacedetect: unable to load the YuNet model\n";
+        return 16;
+    }
+    RequestParams defaults;
+    defaults.detect_size = detect_size;
+    defaults.min_face = (uint32_t)min_face;
+    defaults.backend = backend_name == "lbp" ? BACKEND_LBP
+                     : backend_name == "yunet" ? BACKEND_YUNET : BACKEND_HAAR;
+    defaults.format = format_str == "png" ? FORMAT_PNG
+                    : format_str == "webp" ? FORMAT_WEBP : FORMAT_JPEG;
+    defaults.jpeg_quality = jpeg_quality;
+    defaults.jpeg_flags = (jpeg_optimize ? JPEG_OPTIMIZE : 0) | (jpeg_progressive ? JPEG_PROGRESSIVE : 0);
+    defaults.png_level = png_level;
+    defaults.webp_quality = webp_quality;
+    if (!detector_models.available(defaults.backend)) {
+        std::cerr << "uqfacedetect: the " << backend_name << " detector is not available\n";
+        return 16;
+    }
+    // Detection gets a thread per core; the lighter stages half as many
+    unsigned ncores = WorkerPool::default_size();
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        if (stage_threads[s] == 0) stage_threads[s] = s == STAGE_DETECT ? ncores : std::max(1u, ncores / 2);
+    }
+    // One detector context per detect thread
+    std::vector<DetectorContext> contexts(stage_threads[STAGE_DETECT]);
+    for (auto& ctx : contexts) {
+        if (!detector_models.init_context(ctx)) {
+            std::cerr << "uqfacedetect: unable to load a cascade classifier\n";
+            return 16;
+        }
+    }
+
+    result_cache.set_budget(cache_bytes);
+    detection_cache.set_budget(detcache_bytes);
+    overlay_registry.set_budget(overlay_bytes);
+    receive_buffers.set_limit(pool_bytes);
+
+    // One descriptor per client: allow as many as the hard limit permits
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
     // Block SIGHUP in main thread, it will be handled by sighup_thread
     sigset_t set;
@@ -350,10 +1164,6 @@ int main(int argc, char *argv[]) {
     std::thread sighup_thread(sighup_thread_func);
     sighup_thread.detach();
 
-    // Initialize semaphores
-    sem_init(&file_sem, 0, 1);
-    sem_init(&cascade_sem, 0, 1);
-
     // Setup TCP listening socket
     addrinfo hints = {}, *res;
     hints.ai_family = AF_INET;
@@ -376,7 +1186,7 @@ int main(int argc, char *argv[]) {
         return 3;
     }
     freeaddrinfo(res);
-    if (listen(listen_fd, 5) != 0) {
+    if (listen(listen_fd, SOMAXCONN) != 0) {
         std::cerr << "uqfacedetect: unable to listen on given port \"" << port_str << "\"\n";
         return 3;
     }
@@ -389,21 +1199,23 @@ int main(int argc, char *argv[]) {
         std::cerr.flush();
     }
 
-    // Accept loop
-    while (true) {
-        sockaddr_in client_addr;
-        socklen_t addrlen = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (sockaddr*)&client_addr, &addrlen);
-        if (client_fd < 0) continue;
-        // Connection limiting
-        if (connectionlimit > 0 && active_clients.load() >= connectionlimit) {
-            close(client_fd); // refuse extra clients
-            continue;
-        }
-        // Spawn thread for client
-        std::thread t(handle_client, client_fd, maxsize);
-        t.detach();
+    // Network reactor owns all sockets; complete requests go to the workers
+    Reactor reactor(listen_fd, connectionlimit, maxsize, (uint32_t)maxbatch);
+    if (!reactor.init()) {
+        std::cerr << "uqfacedetect: unable to listen on given port \"" << port_str << "\"\n";
+        return 3;
+    }
+    if (!reactor.set_zerocopy(zerocopy_min)) {
+        std::cerr << "uqfacedetect: zero-copy sends are not supported on this system\n";
+    }
+    // OpenCV's parallel loops run on idle workers of the calling stage.
+    // The first queue is limited by admission control instead
+    WorkerPool::share_with_opencv();
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        stages[s].reset(new Stage(STAGE_NAMES[s], stage_threads[s], s == STAGE_DECODE ? 0 : stage_queue));
     }
+    Dispatcher dispatcher(reactor, contexts, maxsize, queue_limit, queue_wait_ms, defaults);
+    reactor.run([&](Request&& req) { dispatcher.on_request(std::move(req)); });
     // Cleanup (unreachable)
     close(listen_fd);
     return 0;
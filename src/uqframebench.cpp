@@ -0,0 +1,175 @@
+// uqframebench.cpp
+// Loopback benchmark for message reading: counts the recv() and send() calls
+// each reply costs when read by FrameReader::read_frame() and by the older
+// sequence of recv_all() calls for prefix, op, length and data.
+//
+// Usage: ./uqframebench [--count n] [file ...]
+// Each file (e.g. face.jpg) is sent as an OP_OUTPUT_IMAGE payload; with no
+// files, synthetic payloads of 16 B, 4 KiB, 64 KiB and 1 MiB are used.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "protocol.h"
+
+// Calls made by this thread. recv, send and sendmsg are interposed below, so
+// the ones made inside protocol.cpp are counted too.
+static thread_local unsigned long recv_calls;
+static thread_local unsigned long send_calls;
+
+extern "C" ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    ++recv_calls;
+    return syscall(SYS_recvfrom, fd, buf, len, flags, nullptr, nullptr);
+}
+
+extern "C" ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    ++send_calls;
+    return syscall(SYS_sendto, fd, buf, len, flags, nullptr, 0);
+}
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    ++send_calls;
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+// Read one reply the way uqfaceclient did before FrameReader: a recv_all()
+// each for prefix, op, length and payload.
+static bool read_reply_old(int fd, std::vector<char>& data) {
+    char hdr[4];
+    if (!recv_all(fd, hdr, 4) || get_le32(hdr) != PROTOCOL_PREFIX) return false;
+    char op;
+    if (!recv_all(fd, &op, 1)) return false;
+    if (!recv_all(fd, hdr, 4)) return false;
+    data.resize(get_le32(hdr));
+    return data.empty() || recv_all(fd, data.data(), data.size());
+}
+
+// Read one reply through a FrameReader.
+static bool read_reply_new(int fd, FrameReader& reader) {
+    FrameInfo info;
+    FrameStatus status;
+    if (!reader.read_frame(fd, info, status) || status != FRAME_COMPLETE) return false;
+    reader.consume(info.total);
+    return true;
+}
+
+// Result of one run.
+struct Result {
+    double recvs;       // per reply, reading side
+    double sends;       // per reply, sending side
+    double usec;        // per round trip
+};
+
+// Send `count` replies carrying payload over loopback TCP, one at a time:
+// the reader acknowledges each with a byte written by write() (not counted)
+// before the next is sent, as a client waits for each reply.
+static bool run(const std::vector<char>& payload, int count, bool use_reader, Result& res) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (lfd < 0 || bind(lfd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0
+            || getsockname(lfd, (sockaddr *)&addr, &alen) < 0) {
+        perror("uqframebench: listen");
+        return false;
+    }
+    int cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(cfd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("uqframebench: connect");
+        return false;
+    }
+    int sfd = accept(lfd, nullptr, nullptr);
+    close(lfd);
+
+    unsigned long sends = 0;
+    bool sent_ok = true;
+    std::thread writer([&] {
+        char ack;
+        for (int i = 0; i < count && sent_ok; ++i) {
+            sent_ok = send_frame(sfd, OP_OUTPUT_IMAGE, payload.data(), payload.size())
+                && read(sfd, &ack, 1) == 1;
+        }
+        sends = send_calls;
+    });
+
+    recv_calls = 0;
+    bool ok = true;
+    FrameReader reader(0, 0, false);
+    std::vector<char> data;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count && ok; ++i) {
+        ok = use_reader ? read_reply_new(cfd, reader) : read_reply_old(cfd, data);
+        ok = ok && write(cfd, "a", 1) == 1;
+    }
+    double elapsed = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+    unsigned long recvs = recv_calls;
+    if (!ok) shutdown(cfd, SHUT_RDWR);
+    writer.join();
+    close(cfd);
+    close(sfd);
+    res.recvs = (double)recvs / count;
+    res.sends = (double)sends / count;
+    res.usec = elapsed / count;
+    return ok && sent_ok;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 2000;
+    std::vector<std::string> names;
+    std::vector<std::vector<char>> payloads;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            count = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            std::cerr << "Usage: ./uqframebench [--count n] [file ...]\n";
+            return 1;
+        } else {
+            std::ifstream in(argv[i], std::ios::binary);
+            if (!in) {
+                std::cerr << "uqframebench: unable to open \"" << argv[i] << "\"\n";
+                return 1;
+            }
+            names.push_back(argv[i]);
+            payloads.emplace_back(std::istreambuf_iterator<char>(in),
+                                  std::istreambuf_iterator<char>());
+        }
+    }
+    if (payloads.empty()) {
+        for (size_t size : {(size_t)16, (size_t)4096, (size_t)65536, (size_t)1 << 20}) {
+            names.push_back(std::to_string(size) + " B");
+            payloads.emplace_back(size, 'x');
+        }
+    }
+
+    std::cout << std::left << std::setw(24) << "payload" << std::right
+              << std::setw(12) << "bytes" << std::setw(14) << "old recv/rep"
+              << std::setw(14) << "new recv/rep" << std::setw(14) << "send/rep"
+              << std::setw(12) << "old us" << std::setw(12) << "new us" << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        Result old_res, new_res;
+        if (!run(payloads[i], count, false, old_res) || !run(payloads[i], count, true, new_res)) {
+            std::cerr << "uqframebench: transfer failed\n";
+            return 2;
+        }
+        std::cout << std::left << std::setw(24) << names[i] << std::right
+                  << std::setw(12) << payloads[i].size()
+                  << std::setw(14) << old_res.recvs << std::setw(14) << new_res.recvs
+                  << std::setw(14) << new_res.sends
+                  << std::setw(12) << old_res.usec << std::setw(12) << new_res.usec << "\n";
+    }
+    return 0;
+}
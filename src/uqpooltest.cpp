@@ -0,0 +1,164 @@
+// uqpooltest.cpp
+// Stress test for WorkerPool: single, nested and concurrent parallel_for
+// calls, and cv::parallel_for_ from inside a pool, on pools of several
+// sizes. Every iteration must run exactly once, on a worker of the right
+// pool, and every call must return (a watchdog fails the test if one
+// hangs). Exits with 0 on success, 1 otherwise.
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <opencv2/opencv.hpp>
+#include "workerpool.h"
+
+static std::atomic<int> failures(0);
+
+static void fail(const std::string& what) {
+    if (failures.fetch_add(1) < 10) std::cout << "FAIL " << what << "\n";
+}
+
+// One counter per iteration; check() reports any not run exactly once.
+struct Counts {
+    std::unique_ptr<std::atomic<int>[]> hits;
+    size_t n;
+    explicit Counts(size_t n) : hits(new std::atomic<int>[n]), n(n) {
+        for (size_t i = 0; i < n; ++i) hits[i] = 0;
+    }
+    void check(const std::string& what) const {
+        for (size_t i = 0; i < n; ++i) {
+            if (hits[i] != 1) {
+                fail(what + ": iteration " + std::to_string(i) + " ran "
+                     + std::to_string(hits[i].load()) + " times");
+                return;
+            }
+        }
+    }
+};
+
+// The body's worker index must be the caller's own, and in range.
+static void check_worker(WorkerPool& pool, unsigned w, const char *what) {
+    unsigned current;
+    if (WorkerPool::current(current) != &pool || current != w || w >= pool.size()) {
+        fail(std::string(what) + ": body ran on the wrong worker");
+    }
+}
+
+// Submit `tasks` tasks and wait for all of them.
+static void run_tasks(WorkerPool& pool, int tasks, const std::function<void(unsigned, int)>& fn) {
+    std::mutex mutex;
+    std::condition_variable cond;
+    int done = 0;
+    for (int t = 0; t < tasks; ++t) {
+        pool.submit([&, t](unsigned w) {
+            fn(w, t);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++done == tasks) cond.notify_all();
+        });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&] { return done == tasks; });
+}
+
+// One parallel_for of each size.
+static void test_single(WorkerPool& pool) {
+    for (size_t n : { 0, 1, 2, 3, 17, 1000 }) {
+        Counts counts(n);
+        run_tasks(pool, 1, [&](unsigned w, int) {
+            pool.parallel_for(w, n, [&](unsigned w2, size_t i) {
+                check_worker(pool, w2, "single");
+                counts.hits[i]++;
+            });
+        });
+        counts.check("single n=" + std::to_string(n));
+    }
+}
+
+// Three levels of parallel_for inside each other.
+static void test_nested(WorkerPool& pool) {
+    const size_t a = 6, b = 5, c = 7;
+    Counts counts(a * b * c);
+    run_tasks(pool, 1, [&](unsigned w, int) {
+        pool.parallel_for(w, a, [&](unsigned w1, size_t i) {
+            pool.parallel_for(w1, b, [&](unsigned w2, size_t j) {
+                pool.parallel_for(w2, c, [&](unsigned w3, size_t k) {
+                    check_worker(pool, w3, "nested");
+                    counts.hits[(i * b + j) * c + k]++;
+                });
+            });
+        });
+    });
+    counts.check("nested");
+}
+
+// Many tasks running nested parallel_for at once, with bodies that sleep
+// now and then so workers block mid-loop and others steal around them.
+static void test_concurrent(WorkerPool& pool) {
+    const int tasks = 64;
+    const size_t outer = 8, inner = 50;
+    Counts counts(tasks * outer * inner);
+    run_tasks(pool, tasks, [&](unsigned w, int t) {
+        pool.parallel_for(w, outer, [&](unsigned w1, size_t i) {
+            pool.parallel_for(w1, inner, [&](unsigned w2, size_t j) {
+                check_worker(pool, w2, "concurrent");
+                if (j % 16 == 0) usleep(100);
+                counts.hits[(t * outer + i) * inner + j]++;
+            });
+        });
+    });
+    counts.check("concurrent");
+}
+
+// cv::parallel_for_ from pool tasks (on the pool with the backend
+// installed) and from a thread outside any pool (serially).
+static void test_opencv(WorkerPool& pool) {
+    struct Body : cv::ParallelLoopBody {
+        Counts *counts;
+        void operator()(const cv::Range& r) const override {
+            for (int i = r.start; i < r.end; ++i) counts->hits[i]++;
+        }
+    };
+    const int tasks = 8, n = 1000;
+    Counts counts(tasks * n);
+    run_tasks(pool, tasks, [&](unsigned, int t) {
+        Counts part(n);
+        Body body;
+        body.counts = &part;
+        cv::parallel_for_(cv::Range(0, n), body);
+        for (int i = 0; i < n; ++i) counts.hits[t * n + i] += part.hits[i].load();
+    });
+    counts.check("cv::parallel_for_ in pool");
+    Counts outside(n);
+    Body body;
+    body.counts = &outside;
+    cv::parallel_for_(cv::Range(0, n), body);
+    outside.check("cv::parallel_for_ outside pool");
+}
+
+int main() {
+    // A lost wakeup or a deadlock shows up as a hang: fail instead
+    std::thread([] {
+        sleep(120);
+        std::cout << "FAIL timed out\n";
+        _exit(1);
+    }).detach();
+
+    WorkerPool::share_with_opencv();
+    for (unsigned size : { 1u, 2u, 3u, 4u, 8u }) {
+        WorkerPool pool(size);
+        for (int round = 0; round < 5; ++round) {
+            test_single(pool);
+            test_nested(pool);
+            test_concurrent(pool);
+            test_opencv(pool);
+        }
+        std::cout << "pool of " << size << ": " << pool.steals() << " subtasks stolen\n";
+    }
+    std::cout << (failures ? "FAILED" : "ok") << "\n";
+    return failures ? 1 : 0;
+}
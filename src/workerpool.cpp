@@ -0,0 +1,180 @@
+// workerpool.cpp
+#include "workerpool.h"
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 \
+        && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#define HAVE_PARALLEL_BACKEND 1
+#endif
+
+// The pool and worker index of the calling thread, if it is a worker.
+static thread_local WorkerPool *this_pool = nullptr;
+static thread_local unsigned this_worker = 0;
+
+WorkerPool::WorkerPool(unsigned nthreads) : stopping_(false) {
+    if (nthreads == 0) nthreads = 1;
+    for (unsigned i = 0; i < nthreads; ++i) deques_.emplace_back(new Deque);
+    for (unsigned i = 0; i < nthreads; ++i) {
+        threads_.emplace_back(&WorkerPool::worker_main, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+void WorkerPool::submit(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Counted before it can be taken, so pending_ never goes negative
+        pending_.fetch_add(1);
+        injected_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+}
+
+void WorkerPool::parallel_for(unsigned worker, size_t n,
+                              const std::function<void(unsigned, size_t)>& body) {
+    struct Shared {
+        std::atomic<size_t> next, done;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    auto shared = std::make_shared<Shared>();
+    shared->next = 0;
+    shared->done = 0;
+    // Helpers that start after the last call was claimed return without
+    // touching body, which may be gone by then
+    const std::function<void(unsigned, size_t)> *fn = &body;
+    Task run = [shared, fn, n](unsigned w) {
+        size_t i;
+        while ((i = shared->next.fetch_add(1)) < n) {
+            (*fn)(w, i);
+            if (shared->done.fetch_add(1) + 1 == n) {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->cond.notify_all();
+            }
+        }
+    };
+    size_t helpers = std::min<size_t>(n, threads_.size()) - (n > 0);
+    if (helpers > 0) {
+        Deque& own = *deques_[worker];
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            pending_.fetch_add(helpers);
+            for (size_t k = 0; k < helpers; ++k) own.tasks.push_back(run);
+        }
+        // Taking mutex_ orders this with a worker about to sleep
+        { std::lock_guard<std::mutex> lock(mutex_); }
+        if (helpers == 1) cond_.notify_one();
+        else cond_.notify_all();
+    }
+    run(worker);
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->cond.wait(lock, [&] { return shared->done == n; });
+}
+
+WorkerPool *WorkerPool::current(unsigned& worker) {
+    worker = this_worker;
+    return this_pool;
+}
+
+unsigned WorkerPool::default_size() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Find a task for worker `index`: the newest on its own deque, else the
+// oldest on another's (starting with its neighbour, so thieves spread
+// out), else the oldest from outside.
+bool WorkerPool::take(unsigned index, Task& task) {
+    {
+        Deque& own = *deques_[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            pending_.fetch_sub(1);
+            return true;
+        }
+    }
+    size_t n = deques_.size();
+    for (size_t k = 1; k < n; ++k) {
+        Deque& victim = *deques_[(index + k) % n];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending_.fetch_sub(1);
+            steals_.fetch_add(1);
+            return true;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (injected_.empty()) return false;
+    task = std::move(injected_.front());
+    injected_.pop_front();
+    pending_.fetch_sub(1);
+    return true;
+}
+
+void WorkerPool::worker_main(unsigned index) {
+    this_pool = this;
+    this_worker = index;
+    while (true) {
+        Task task;
+        if (!take(index, task)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return stopping_ || pending_.load() > 0; });
+            if (stopping_ && pending_.load() == 0) return; // stopping and drained
+            continue;
+        }
+        task(index);
+    }
+}
+
+#ifdef HAVE_PARALLEL_BACKEND
+// cv::parallel_for_ on the calling thread's pool. OpenCV splits a loop
+// into `tasks` stripes; body(start, end) runs a range of them.
+class PoolParallelBackend : public cv::parallel::ParallelForAPI {
+public:
+    void parallel_for(int tasks, FN_parallel_for_body_cb_t body, void *data) override {
+        unsigned worker;
+        WorkerPool *pool = WorkerPool::current(worker);
+        if (!pool || pool->size() == 1 || tasks <= 1) {
+            body(0, tasks, data);
+            return;
+        }
+        // A few stripes per call keeps the per-call overhead small
+        size_t chunks = std::min<size_t>(tasks, pool->size() * 4);
+        pool->parallel_for(worker, chunks, [&](unsigned, size_t i) {
+            body((int)(tasks * i / chunks), (int)(tasks * (i + 1) / chunks), data);
+        });
+    }
+    int getThreadNum() const override {
+        unsigned worker;
+        return WorkerPool::current(worker) ? (int)worker : 0;
+    }
+    int getNumThreads() const override {
+        unsigned worker;
+        WorkerPool *pool = WorkerPool::current(worker);
+        return pool ? (int)pool->size() : 1;
+    }
+    int setNumThreads(int) override { return getNumThreads(); }
+    const char *getName() const override { return "workerpool"; }
+};
+#endif
+
+void WorkerPool::share_with_opencv() {
+#ifdef HAVE_PARALLEL_BACKEND
+    cv::parallel::setParallelForBackend(std::make_shared<PoolParallelBackend>(), false);
+#else
+    cv::setNumThreads(1);
+#endif
+}
@@ -0,0 +1,77 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of CPU worker threads with work stealing. Tasks from
+// outside the pool are queued FIFO; subtasks a worker spawns go on its
+// own deque, which it works from the back while idle workers steal from
+// the front. A worker takes subtasks (its own, then stolen ones) before
+// new outside tasks, so requests already started finish first.
+// Each task is told the index of the worker running it, so callers can keep
+// per-worker state (e.g. detector contexts) without locking.
+class WorkerPool {
+public:
+    typedef std::function<void(unsigned worker)> Task;
+
+    explicit WorkerPool(unsigned nthreads);
+    ~WorkerPool();
+
+    // Queue a task for execution on the next free worker.
+    void submit(Task task);
+
+    // Run body(w, i) for every i in [0, n), where w is the worker running
+    // that call, and return once all are done. Must be called from worker
+    // `worker`, which takes part itself; idle workers join in by stealing
+    // helper tasks from its deque. Calls are claimed one at a time, so the
+    // caller never waits for a call nobody has started: it cannot deadlock
+    // even when every other worker is busy, or when body itself calls
+    // parallel_for.
+    void parallel_for(unsigned worker, size_t n, const std::function<void(unsigned, size_t)>& body);
+
+    unsigned size() const { return (unsigned)threads_.size(); }
+
+    // Helper tasks taken from another worker's deque.
+    uint64_t steals() const { return steals_.load(); }
+
+    // The pool whose worker is running the calling thread, or null; its
+    // index is stored in `worker`.
+    static WorkerPool *current(unsigned& worker);
+
+    // Number of workers to use when none is specified: one per core.
+    static unsigned default_size();
+
+    // Send cv::parallel_for_ to the pool of the calling thread, run
+    // serially elsewhere, so OpenCV's own threads do not compete with the
+    // pools for cores. Where OpenCV lacks a pluggable parallel backend
+    // (before 4.5.2) its threading is turned off instead.
+    static void share_with_opencv();
+
+private:
+    struct Deque {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void worker_main(unsigned index);
+    bool take(unsigned index, Task& task);
+
+    std::vector<std::unique_ptr<Deque>> deques_;   // one per worker
+    std::mutex mutex_;                             // guards injected_, sleeping
+    std::condition_variable cond_;
+    std::deque<Task> injected_;                    // tasks from outside
+    std::atomic<long> pending_{0};                 // tasks queued anywhere
+    std::atomic<uint64_t> steals_{0};
+    std::vector<std::thread> threads_;
+    bool stopping_;
+};
+
+#endif // WORKERPOOL_H